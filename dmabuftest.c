@@ -18,9 +18,56 @@
 
 #include "util.h"
 
-#define NBUF 3
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/* the display holds up to two (one on screen, one flipping to), one may
+ * wait to be posted, and the rest are with the camera:
+ */
+#define NBUF 5
 #define CNT  500
 
+/* Everything is driven from one epoll loop: the camera, the flip events of
+ * the display, and with --fps, a timerfd which paces the posts.  Posting
+ * does not block, a frame the display can't take yet is posted after the
+ * next flip event, unless a newer frame replaced it by then.  A buffer goes
+ * back to the camera (or the converter) only once the display released it,
+ * or the frame in it was dropped.
+ */
+enum {
+	EV_CAPTURE, EV_DISPLAY, EV_TIMER,
+};
+
+struct capture {
+	struct v4l2 *v4l2;
+	struct convert *conv;
+	struct buffer *framebuf;
+	bool streaming;
+};
+
+/* done with the frame in buf, give the buffer back: */
+static void
+recycle(struct capture *cap, struct buffer *buf)
+{
+	if (cap->conv)
+		convert_put(cap->conv, buf);
+	else if (cap->streaming)
+		v4l2_qbuf(cap->v4l2, buf);
+}
+
+static void
+release(struct display *disp, struct buffer *buf, void *data)
+{
+	struct capture *cap = data;
+
+	/* the UI buffer stays on screen until the end: */
+	if (buf == cap->framebuf)
+		return;
+
+	TRACE_INSTANT("release", buf);
+	recycle(cap, buf);
+}
+
 static void
 usage(char *name)
 {
@@ -31,15 +78,63 @@ usage(char *name)
 	v4l2_usage();
 }
 
+static int
+watch(int epfd, int fd, uint32_t tag)
+{
+	struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.u32 = tag,
+	};
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		ERROR("epoll_ctl failed: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* a periodic timer at the --fps rate: */
+static int
+pace_timer(struct rate_control *p)
+{
+	uint64_t period = (uint64_t)p->fps_den * NSEC_PER_SEC / p->fps_num;
+	struct itimerspec its = {
+			.it_interval = {
+				.tv_sec = period / NSEC_PER_SEC,
+				.tv_nsec = period % NSEC_PER_SEC,
+			},
+	};
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		ERROR("timerfd_create failed: %s", strerror(errno));
+		return -1;
+	}
+
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL)) {
+		ERROR("timerfd_settime failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct display *disp;
 	struct v4l2 *v4l2;
-	struct buffer *framebuf;
+	struct capture cap = {0};
+	struct buffer *pending = NULL;
+	struct buffer *converting[NBUF];
 	struct buffer **buffers;
 	uint32_t fourcc, width, height;
-	int ret, i;
+	int ret = 0, i, epfd, tfd = -1, dropped = 0, nconverting = 0;
+	bool tick = true;
 
 	MSG("Opening Display..");
 	disp = disp_open(argc, argv);
@@ -61,31 +156,153 @@ main(int argc, char **argv)
 		return 0;
 	}
 
-	framebuf = disp_get_fb(disp);
+	cap.v4l2 = v4l2;
+	cap.framebuf = disp_get_fb(disp);
 
 	buffers = disp_get_vid_buffers(disp, NBUF, fourcc, width, height);
 	if (!buffers) {
 		return 1;
 	}
 
+	/* if the display can't scan out the camera format, convert.  One
+	 * more converted buffer than the display may hold, for the one being
+	 * converted:
+	 */
+	if (!disp_supports_format(disp, fourcc)) {
+		cap.conv = convert_open(disp, fourcc, width, height, 4);
+		if (!cap.conv) {
+			return 1;
+		}
+	}
+
+	disp_set_release(disp, release, &cap);
+
 	ret = v4l2_reqbufs(v4l2, buffers, NBUF);
 	if (ret) {
 		return 1;
 	}
 
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		ERROR("epoll_create1 failed: %s", strerror(errno));
+		return 1;
+	}
+
+	if (watch(epfd, v4l2_get_fd(v4l2), EV_CAPTURE))
+		return 1;
+
+	/* displays which can't post without blocking just do so: */
+	if (!disp_set_nonblock(disp, true) &&
+			watch(epfd, disp_get_fd(disp), EV_DISPLAY))
+		return 1;
+
+	/* posts are paced here when the display does not: */
+	if (disp->nonblock && disp->rtctl.fps_num) {
+		tfd = pace_timer(&disp->rtctl);
+		if ((tfd < 0) || watch(epfd, tfd, EV_TIMER))
+			return 1;
+		tick = false;
+	}
+
+	cap.streaming = true;
 	v4l2_qbuf(v4l2, buffers[0]);
 	v4l2_streamon(v4l2);
-	for (i = 1; i < CNT; i++) {
-		v4l2_qbuf(v4l2, buffers[i % NBUF]);
-		ret = disp_post_vid_buffer(disp, v4l2_dqbuf(v4l2),
-				0, 0, width, height);
+	for (i = 1; i < NBUF; i++)
+		v4l2_qbuf(v4l2, buffers[i]);
+
+	for (i = 0; i < CNT; ) {
+		struct epoll_event events[3];
+		int j, n;
+
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("epoll_wait failed: %s", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		for (j = 0; j < n; j++) {
+			struct buffer *buf;
+			uint64_t expirations;
+
+			switch (events[j].data.u32) {
+			case EV_DISPLAY:
+				disp_dispatch(disp, 0);
+				break;
+			case EV_TIMER:
+				if (read(tfd, &expirations, sizeof(expirations)) > 0)
+					tick = true;
+				break;
+			case EV_CAPTURE:
+				TRACE_BEGIN("capture", NULL);
+				buf = v4l2_dqbuf(v4l2);
+				i++;
+
+				if (buf && cap.conv) {
+					/* the frame is converted while the previous
+					 * one is posted.  The converted frames come
+					 * out in order, and once one does, its camera
+					 * buffer is done with:
+					 */
+					convert_queue(cap.conv, buf);
+					converting[nconverting++] = buf;
+					buf = NULL;
+					if (nconverting > 1) {
+						buf = convert_dequeue(cap.conv);
+						v4l2_qbuf(v4l2, converting[0]);
+						memmove(converting, converting + 1,
+								--nconverting * sizeof(*converting));
+					}
+				}
+				TRACE_END("capture", buf);
+
+				if (!buf)
+					break;
+
+				/* the display did not take the last one in time: */
+				if (pending) {
+					TRACE_INSTANT("drop", pending);
+					recycle(&cap, pending);
+					dropped++;
+				}
+				pending = buf;
+				break;
+			}
+		}
+
+		if (!pending || !tick)
+			continue;
+
+		TRACE_BEGIN("frame", pending);
+		ret = disp_post_vid_buffer(disp, pending, 0, 0, width, height);
+		TRACE_END("frame", pending);
+		if (ret == -EAGAIN) {
+			/* posted after the next flip event: */
+			ret = 0;
+			continue;
+		}
 		if (ret) {
-			return ret;
+			break;
 		}
+
+		/* the display has it until it is released: */
+		pending = NULL;
+		tick = (tfd < 0);
 	}
+	cap.streaming = false;
 	v4l2_streamoff(v4l2);
 	v4l2_dqbuf(v4l2);
 
+	MSG("%d frames dropped", dropped);
+
+	if (tfd >= 0)
+		close(tfd);
+	close(epfd);
+
+	convert_close(cap.conv);
+
 	MSG("Ok!");
 	disp_close(disp);
 
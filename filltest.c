@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util.h"
+
+#define CNT  100
+
+static const char *impls[] = { "ref", "c", "sse2", "neon" };
+
+static void
+usage(char *name)
+{
+	MSG("Usage: %s [OPTION]...", name);
+	MSG("Benchmark of the fill() test pattern generators, color conversion and rotation.");
+	MSG("");
+	MSG("filltest options:");
+	MSG("\t--size WxH\tbuffer dimensions (default 1920x1080)");
+	MSG("\t--count N\tnumber of frames to fill per format (default %d)", CNT);
+	MSG("");
+	disp_usage();
+}
+
+static double
+now_us(void)
+{
+	return time_ns() / 1000.0;
+}
+
+static void
+snapshot(struct buffer *buf, void **copy)
+{
+	int i;
+	if (!buf->nbo) {
+		copy[0] = realloc(copy[0], buf->size);
+		memcpy(copy[0], buf->map, buf->size);
+		return;
+	}
+	for (i = 0; i < buf->nbo; i++) {
+		uint32_t sz = omap_bo_size(buf->bo[i]);
+		copy[i] = realloc(copy[i], sz);
+		memcpy(copy[i], omap_bo_map(buf->bo[i]), sz);
+	}
+}
+
+static bool
+compare(struct buffer *buf, void **copy)
+{
+	int i;
+	if (!buf->nbo)
+		return !memcmp(copy[0], buf->map, buf->size);
+	for (i = 0; i < buf->nbo; i++) {
+		if (memcmp(copy[i], omap_bo_map(buf->bo[i]),
+				omap_bo_size(buf->bo[i])))
+			return false;
+	}
+	return true;
+}
+
+/* throughput of the color conversion kernels, on system memory: */
+static void
+bench_color(uint32_t width, uint32_t height, int cnt)
+{
+	uint32_t *rgb = malloc(width * sizeof(*rgb));
+	uint8_t *y = malloc(width), *u = malloc(width), *v = malloc(width);
+	enum color_space cs;
+	uint32_t i;
+	int k;
+
+	for (i = 0; i < width; i++)
+		rgb[i] = (i * 0x00130502) ^ (i << 11);
+
+	for (cs = COLOR_BT601; cs <= COLOR_BT709_FULL; cs++) {
+		const struct color_conv *cc = color_get(cs);
+		double t;
+
+		t = now_us();
+		for (k = 0; k < cnt; k++)
+			for (i = 0; i < height; i++)
+				color_xrgb_to_yuv_row(cc, rgb, y, u, v, width);
+		t = now_us() - t;
+		MSG("%-10s xrgb->yuv: %8.1f MPix/s", cc->name,
+				(double)width * height * cnt / t);
+
+		t = now_us();
+		for (k = 0; k < cnt; k++)
+			for (i = 0; i < height; i++)
+				color_yuv_to_xrgb_row(cc, y, u, v, rgb, width);
+		t = now_us() - t;
+		MSG("%-10s yuv->xrgb: %8.1f MPix/s", cc->name,
+				(double)width * height * cnt / t);
+	}
+
+	free(rgb);
+	free(y);
+	free(u);
+	free(v);
+}
+
+/* what --rotate costs per frame when the planes can't rotate and the cpu
+ * does it, which scanning out a rotated view saves entirely.  Rotating by 0
+ * is a plain copy, for reference:
+ */
+static int
+bench_rotate(struct display *disp, uint32_t width, uint32_t height, int cnt)
+{
+	static const uint32_t fourccs[] = { 0, FOURCC('N','V','1','2') };
+	int i, k, ret = 0;
+
+	for (i = 0; i < (int)ARRAY_SIZE(fourccs); i++) {
+		struct buffer **src, **dst, **dst90;
+		uint32_t fourcc = fourccs[i], deg;
+
+		/* straight from the backend, they are not posted: */
+		src = disp->get_vid_buffers(disp, 1, fourcc, width, height);
+		dst = disp->get_vid_buffers(disp, 1, fourcc, width, height);
+		dst90 = disp->get_vid_buffers(disp, 1, fourcc, height, width);
+		if (!src || !dst || !dst90) {
+			ERROR("could not allocate %.4s buffers to rotate",
+					fourcc ? (char *)&fourcc : "RGB4");
+			ret = 1;
+			goto next;
+		}
+
+		fill(src[0], 0);
+
+		for (deg = 0; deg < 360; deg += 90) {
+			struct buffer *out = (deg % 180) ? dst90[0] : dst[0];
+			double t;
+
+			t = now_us();
+			for (k = 0; k < cnt; k++) {
+				if (convert_rotate(src[0], 0, 0, width, height, out, deg)) {
+					ERROR("rotate by %u failed", deg);
+					ret = 1;
+					break;
+				}
+			}
+			t = now_us() - t;
+
+			MSG("%.4s %ux%u rotate %3u: %8.1f MPix/s (%.3f ms/frame)",
+					fourcc ? (char *)&fourcc : "RGB4", width, height,
+					deg, (double)width * height * cnt / t,
+					t / cnt / 1000.0);
+		}
+
+next:
+		disp->free_buffers(disp, src, 1);
+		disp->free_buffers(disp, dst, 1);
+		disp->free_buffers(disp, dst90, 1);
+	}
+
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint32_t fourccs[] = {
+			0, FOURCC('Y','U','Y','V'),
+			FOURCC('N','V','1','2'), FOURCC('I','4','2','0'),
+	};
+	struct display *disp;
+	uint32_t width = 1920, height = 1080;
+	int i, j, k, cnt = CNT, ret = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!argv[i]) {
+			continue;
+		}
+		if (!strcmp("--size", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%ux%u", &width, &height) != 2) {
+				ERROR("invalid arg: %s", argv[i]);
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp("--count", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%d", &cnt) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				usage(argv[0]);
+				return 1;
+			}
+		} else {
+			continue;
+		}
+		argv[i] = NULL;
+	}
+
+	MSG("Opening Display..");
+	disp = disp_open(argc, argv);
+	if (!disp) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (check_args(argc, argv)) {
+		/* remaining args.. print usage msg */
+		usage(argv[0]);
+		return 0;
+	}
+
+	/* the template path is benchmarked separately, below: */
+	fill_set_template(false);
+
+	for (i = 0; i < (int)ARRAY_SIZE(fourccs); i++) {
+		void *ref[4] = {0};
+		struct buffer **bufs;
+		uint32_t fourcc = fourccs[i];
+
+		bufs = disp_get_vid_buffers(disp, 1, fourcc, width, height);
+		if (!bufs) {
+			ERROR("could not allocate %dx%d %.4s buffer", width, height,
+					fourcc ? (char *)&fourcc : "RGB4");
+			ret = 1;
+			continue;
+		}
+
+		/* each implementation, and then the template path: */
+		for (j = 0; j <= (int)ARRAY_SIZE(impls); j++) {
+			const char *name = "tmpl";
+			double t;
+
+			if (j < (int)ARRAY_SIZE(impls)) {
+				name = impls[j];
+				if (fill_select(name))
+					continue;
+			} else {
+				fill_select(NULL);
+				fill_set_template(true);
+			}
+
+			t = now_us();
+			for (k = 0; k < cnt; k++)
+				fill(bufs[0], k * 2);
+			t = now_us() - t;
+
+			/* check against the reference output of the last frame: */
+			if (j == 0) {
+				snapshot(bufs[0], ref);
+			} else if (!compare(bufs[0], ref)) {
+				ERROR("%s: output differs from reference!", name);
+				ret = 1;
+			}
+
+			MSG("%.4s %ux%u %-5s: %8.1f MPix/s (%.3f ms/frame)",
+					fourcc ? (char *)&fourcc : "RGB4", width, height,
+					name, (double)width * height * cnt / t,
+					t / cnt / 1000.0);
+		}
+
+		fill_set_template(false);
+
+		for (j = 0; j < 4; j++)
+			free(ref[j]);
+		disp_free_buffers(disp, bufs, 1);
+	}
+
+	fill_select(NULL);
+
+	bench_color(width, height, cnt);
+
+	if (bench_rotate(disp, width, height, cnt))
+		ret = 1;
+
+	if (!ret)
+		MSG("Ok!");
+	disp_close(disp);
+
+	return ret;
+}
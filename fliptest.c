@@ -15,12 +15,27 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-
 #include "util.h"
 
 #define NBUF 3
 #define CNT  500
 
+/* number of frames to fill single threaded, to compute the speedup: */
+#define CALIB_CNT 20
+
+/* each output of the display (see --split) flips on its own: */
+struct output {
+	struct display *disp;
+	struct buffer **buffers;
+	/* buffers which are on screen, or about to be: */
+	bool busy[NBUF];
+};
+
+#define MAX_OUTPUTS 10
+
+static struct output outputs[MAX_OUTPUTS];
+static int noutputs;
+
 static void
 usage(char *name)
 {
@@ -30,12 +45,53 @@ usage(char *name)
 	disp_usage();
 }
 
+static long
+fill_time(struct buffer *buf, int n)
+{
+	uint64_t t = time_ns();
+	fill(buf, n);
+	return mark_ns(&t) / 1000;
+}
+
+static void
+release(struct display *disp, struct buffer *buf, void *data)
+{
+	struct output *out = data;
+	int i;
+
+	for (i = 0; i < NBUF; i++)
+		if (out->buffers[i] == buf)
+			out->busy[i] = false;
+}
+
+/* posting does not wait for the flip, so the next frame is filled while it
+ * is in flight, into a buffer which is not on screen:
+ */
+static struct buffer *
+get_free_buffer(struct output *out)
+{
+	int i;
+
+	for (;;) {
+		for (i = 0; i < NBUF; i++) {
+			if (!out->busy[i]) {
+				out->busy[i] = true;
+				return out->buffers[i];
+			}
+		}
+
+		if (disp_dispatch(out->disp, -1) < 0)
+			return NULL;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
-	struct display *disp;
-	struct buffer **buffers;
-	int ret, i;
+	struct display *disp, *d;
+	long long tfill = 0, tsingle = 0;
+	uint64_t t;
+	int ret, i, j, nthreads;
 
 	MSG("Opening Display..");
 	disp = disp_open(argc, argv);
@@ -50,20 +106,54 @@ main(int argc, char **argv)
 		return 0;
 	}
 
-	buffers = disp_get_buffers(disp, NBUF);
-	if (!buffers) {
-		return 1;
+	for (d = disp; d && (noutputs < MAX_OUTPUTS); d = d->next_output) {
+		struct output *out = &outputs[noutputs++];
+
+		out->disp = d;
+		out->buffers = disp_get_buffers(d, NBUF);
+		if (!out->buffers) {
+			return 1;
+		}
+
+		disp_set_release(d, release, out);
 	}
 
+	t = time_ns();
 	for (i = 0; i < CNT; i++) {
-		struct buffer *buf = buffers[i % NBUF];
-		fill(buf, i * 2);
-		ret = disp_post_buffer(disp, buf);
-		if (ret) {
-			return ret;
+		for (j = 0; j < noutputs; j++) {
+			struct output *out = &outputs[j];
+			struct buffer *buf = get_free_buffer(out);
+			if (!buf) {
+				return 1;
+			}
+			TRACE_BEGIN("frame", buf);
+			tfill += fill_time(buf, i * 2);
+			ret = disp_post_buffer(out->disp, buf);
+			TRACE_END("frame", buf);
+			if (ret) {
+				return ret;
+			}
 		}
 	}
 
+	MSG("%.2f fps on %d output(s)", (double)CNT * NSEC_PER_SEC / (time_ns() - t),
+			noutputs);
+
+	nthreads = fill_get_threads();
+	MSG("fill: %.3f ms/frame with %d thread(s)", tfill / 1000.0 / CNT / noutputs,
+			nthreads);
+
+	if (nthreads > 1) {
+		fill_set_threads(1);
+		for (i = 0; i < CALIB_CNT; i++)
+			tsingle += fill_time(outputs[0].buffers[i % NBUF], i * 2);
+		fill_set_threads(nthreads);
+
+		MSG("fill: %.3f ms/frame with 1 thread, speedup: %.2fx",
+				tsingle / 1000.0 / CALIB_CNT,
+				((double)tsingle / CALIB_CNT) / ((double)tfill / CNT / noutputs));
+	}
+
 	MSG("Ok!");
 	disp_close(disp);
 
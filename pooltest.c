@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+
+#include "util.h"
+
+#define NBUF     16
+#define CNT      1000000
+#define THREADS  8
+
+/* Contention benchmark of the buffer pool: n producer threads move buffers
+ * from a "free" pool to a "full" pool, and n consumer threads move them
+ * back, like a decoder and display would.  For comparison the same is done
+ * with a mutex protected queue.
+ */
+
+struct queue_ops {
+	const char *name;
+	void * (*new)(uint32_t size);
+	void (*free)(void *q);
+	bool (*put)(void *q, struct buffer *buf);
+	struct buffer * (*get)(void *q);	/* blocking */
+	struct buffer * (*try_get)(void *q);
+};
+
+/* pool: */
+
+static void *
+pool_new_op(uint32_t size)
+{
+	return pool_new(size);
+}
+
+static void
+pool_free_op(void *q)
+{
+	pool_free(q);
+}
+
+static bool
+pool_put_op(void *q, struct buffer *buf)
+{
+	return pool_put(q, buf);
+}
+
+static struct buffer *
+pool_get_op(void *q)
+{
+	return pool_get_timeout(q, -1);
+}
+
+static struct buffer *
+pool_try_get_op(void *q)
+{
+	return pool_get(q);
+}
+
+/* mutex protected ring: */
+
+struct locked {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t size, head, cnt;
+	struct buffer *bufs[];
+};
+
+static void *
+locked_new(uint32_t size)
+{
+	struct locked *q = calloc(1, sizeof(*q) + size * sizeof(q->bufs[0]));
+	if (!q)
+		return NULL;
+	q->size = size;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	return q;
+}
+
+static void
+locked_free(void *data)
+{
+	struct locked *q = data;
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+static bool
+locked_put(void *data, struct buffer *buf)
+{
+	struct locked *q = data;
+	bool ret = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->cnt < q->size) {
+		q->bufs[(q->head + q->cnt++) % q->size] = buf;
+		pthread_cond_signal(&q->cond);
+		ret = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+static struct buffer *
+locked_get(void *data)
+{
+	struct locked *q = data;
+	struct buffer *buf;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->cnt)
+		pthread_cond_wait(&q->cond, &q->lock);
+	buf = q->bufs[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->cnt--;
+	pthread_mutex_unlock(&q->lock);
+
+	return buf;
+}
+
+static struct buffer *
+locked_try_get(void *data)
+{
+	struct locked *q = data;
+	struct buffer *buf = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->cnt) {
+		buf = q->bufs[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->cnt--;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return buf;
+}
+
+static const struct queue_ops queues[] = {
+		{ "pool",  pool_new_op, pool_free_op, pool_put_op, pool_get_op, pool_try_get_op },
+		{ "mutex", locked_new, locked_free, locked_put, locked_get, locked_try_get },
+};
+
+struct bench {
+	const struct queue_ops *ops;
+	void *from, *to;
+	int cnt;
+	pthread_t thread;
+};
+
+static void *
+bench_thread(void *data)
+{
+	struct bench *b = data;
+	int i;
+
+	for (i = 0; i < b->cnt; i++) {
+		struct buffer *buf = b->ops->get(b->from);
+		if (!b->ops->put(b->to, buf))
+			ERROR("%s: put failed", b->ops->name);
+	}
+
+	return NULL;
+}
+
+static double
+now_us(void)
+{
+	return time_ns() / 1000.0;
+}
+
+/* returns the number of buffers lost, which should be zero: */
+static int
+run(const struct queue_ops *ops, int n, int cnt)
+{
+	struct buffer bufs[NBUF];
+	struct bench *b = calloc(2 * n, sizeof(*b));
+	void *free_q = ops->new(NBUF), *full_q = ops->new(NBUF);
+	double t;
+	int i, lost = 0;
+
+	for (i = 0; i < NBUF; i++)
+		ops->put(free_q, &bufs[i]);
+
+	t = now_us();
+	for (i = 0; i < 2 * n; i++) {
+		b[i].ops = ops;
+		b[i].cnt = cnt / n;
+		/* even threads are producers, odd threads consumers: */
+		b[i].from = (i & 1) ? full_q : free_q;
+		b[i].to   = (i & 1) ? free_q : full_q;
+		pthread_create(&b[i].thread, NULL, bench_thread, &b[i]);
+	}
+	for (i = 0; i < 2 * n; i++)
+		pthread_join(b[i].thread, NULL);
+	t = now_us() - t;
+
+	MSG("%-5s %d+%d threads: %8.3f Mops/s (%.1f ns/op)", ops->name, n, n,
+			2.0 * n * (cnt / n) / t, t * 1000.0 / (2.0 * n * (cnt / n)));
+
+	/* every buffer should have made it back: */
+	for (i = 0; i < NBUF; i++)
+		if (!ops->try_get(free_q))
+			lost++;
+	if (ops->try_get(full_q) || ops->try_get(free_q))
+		ERROR("%s: buffers duplicated!", ops->name);
+
+	ops->free(full_q);
+	ops->free(free_q);
+	free(b);
+
+	return lost;
+}
+
+static void
+usage(char *name)
+{
+	MSG("Usage: %s [OPTION]...", name);
+	MSG("Contention benchmark of the video buffer pool.");
+	MSG("");
+	MSG("pooltest options:");
+	MSG("\t--threads N\tmax number of producer/consumer thread pairs (default %d)", THREADS);
+	MSG("\t--count N\tnumber of buffers passed per run (default %d)", CNT);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, n, threads = THREADS, cnt = CNT, ret = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp("--threads", argv[i]) && (i + 1 < argc)) {
+			if (sscanf(argv[++i], "%d", &threads) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp("--count", argv[i]) && (i + 1 < argc)) {
+			if (sscanf(argv[++i], "%d", &cnt) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				usage(argv[0]);
+				return 1;
+			}
+		} else {
+			ERROR("invalid arg: %s", argv[i]);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for (n = 1; n <= threads; n++) {
+		for (i = 0; i < (int)ARRAY_SIZE(queues); i++) {
+			int lost = run(&queues[i], n, cnt);
+			if (lost) {
+				ERROR("%s: %d buffers lost!", queues[i].name, lost);
+				ret = 1;
+			}
+		}
+	}
+
+	if (!ret)
+		MSG("Ok!");
+
+	return ret;
+}
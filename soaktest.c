@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+
+#include "util.h"
+
+#define NBUF    3
+#define CNT     10000
+
+/* iterations before the baseline is taken, so that anything allocated once
+ * (libraries, fill threads, ..) is not counted as a leak:
+ */
+#define WARMUP  10
+
+/* allowed growth of the resident set over the whole run: */
+#define SLACK_KB 512
+
+/* Soak test of the display lifecycle: the display is opened, buffers are
+ * allocated, filled, posted and freed, and the display is closed again, over
+ * and over.  The resident memory and number of open fds must stay flat.
+ */
+
+static void
+usage(char *name)
+{
+	MSG("Usage: %s [OPTION]...", name);
+	MSG("Display open/close soak test, checks for memory and fd leaks.");
+	MSG("");
+	MSG("Soak test options:");
+	MSG("\t--count <n>\tnumber of open/close cycles (default %d)", CNT);
+	MSG("\t--size <width>x<height>\tsize of the video buffers (default 640x480)");
+	MSG("");
+	disp_usage();
+}
+
+static long
+rss_kb(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long size, resident = 0;
+
+	if (f) {
+		if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int
+open_fds(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *de;
+	int n = 0;
+
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir)))
+		if (de->d_name[0] != '.')
+			n++;
+	closedir(dir);
+
+	return n;
+}
+
+/* one open/close cycle, argv is not modified: */
+static int
+cycle(int argc, char **argv, uint32_t width, uint32_t height, int n)
+{
+	struct display *disp;
+	struct buffer **bufs, **vid_bufs, *buf;
+	char **args;
+	int i, ret = 0;
+
+	/* disp_open() clears the args it consumes: */
+	args = malloc(argc * sizeof(*args));
+	if (!args)
+		return -1;
+	memcpy(args, argv, argc * sizeof(*args));
+
+	disp = disp_open(argc, args);
+	if (!disp) {
+		free(args);
+		return -1;
+	}
+
+	if ((n == 0) && check_args(argc, args)) {
+		ret = -1;
+		goto out;
+	}
+
+	/* not every backend has UI buffers, these are left to disp_close(): */
+	bufs = disp_get_buffers(disp, NBUF);
+	if (bufs) {
+		fill(bufs[0], n);
+		ret = disp_post_buffer(disp, bufs[0]);
+		free(bufs);
+	}
+
+	vid_bufs = disp_get_vid_buffers(disp, NBUF,
+			FOURCC('N','V','1','2'), width, height);
+	if (!vid_bufs) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < NBUF; i++) {
+		buf = disp_get_vid_buffer(disp);
+		if (!buf) {
+			ret = -1;
+			break;
+		}
+		fill(buf, n + i);
+		ret = disp_post_vid_buffer(disp, buf, 0, 0, width, height);
+		disp_put_vid_buffer(disp, buf);
+		if (ret)
+			break;
+	}
+
+	disp_free_buffers(disp, vid_bufs, NBUF);
+
+out:
+	disp_close(disp);
+	free(args);
+
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t width = 640, height = 480;
+	long rss0 = 0, rss;
+	int i, cnt = CNT, fds0 = 0, fds;
+
+	for (i = 1; i < argc; i++) {
+		if (!argv[i]) {
+			continue;
+		}
+		if (!strcmp("--size", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%ux%u", &width, &height) != 2) {
+				ERROR("invalid arg: %s", argv[i]);
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp("--count", argv[i])) {
+			argv[i++] = NULL;
+			if ((sscanf(argv[i], "%d", &cnt) != 1) || (cnt <= WARMUP)) {
+				ERROR("invalid arg: %s", argv[i]);
+				usage(argv[0]);
+				return 1;
+			}
+		} else {
+			continue;
+		}
+		argv[i] = NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (cycle(argc, argv, width, height, i)) {
+			ERROR("cycle %d failed", i);
+			if (i == 0)
+				usage(argv[0]);
+			return 1;
+		}
+
+		if (mem_current_bytes()) {
+			ERROR("cycle %d: %llu bytes of bo's not freed", i,
+					(unsigned long long)mem_current_bytes());
+			return 1;
+		}
+
+		if (i == WARMUP) {
+			rss0 = rss_kb();
+			fds0 = open_fds();
+		}
+
+		if ((i % 1000) == 0)
+			MSG("cycle %d: %ld KiB resident, %d fds", i, rss_kb(), open_fds());
+	}
+
+	rss = rss_kb();
+	fds = open_fds();
+
+	MSG("%d cycles: resident %ld -> %ld KiB, fds %d -> %d",
+			cnt, rss0, rss, fds0, fds);
+
+	if ((rss - rss0 > SLACK_KB) || (fds != fds0)) {
+		ERROR("leak detected!");
+		return 1;
+	}
+
+	MSG("Ok!");
+
+	return 0;
+}
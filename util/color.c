@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+/* RGB <-> YCbCr conversion, in COLOR_SHIFT fixed point.  The matrices are
+ * derived from the Kr/Kb constants of each standard:
+ *
+ *   Y  = Kr*R + Kg*G + Kb*B                 (Kg = 1 - Kr - Kb)
+ *   Cb = (B - Y) / (2 * (1 - Kb))
+ *   Cr = (R - Y) / (2 * (1 - Kr))
+ *
+ * scaled to 16..235/16..240 for limited range, or 0..255 for full range,
+ * with chroma centered on 128.
+ */
+
+#define Q(x)  ((int32_t)(((x) * (1 << COLOR_SHIFT)) + (((x) < 0) ? -0.5 : 0.5)))
+
+#define KG(kr, kb)  (1.0 - (kr) - (kb))
+
+#define COLOR_CONV(_name, _cs, kr, kb, full) {                               \
+	.name = _name,                                                          \
+	.cs = _cs,                                                              \
+	/* rgb -> yuv: */                                                       \
+	.yr = Q((kr) * YS(full)),                                               \
+	.yg = Q(KG(kr, kb) * YS(full)),                                         \
+	.yb = Q((kb) * YS(full)),                                               \
+	.ur = Q(-(kr) / (2.0 * (1.0 - (kb))) * CS(full)),                       \
+	.ug = Q(-KG(kr, kb) / (2.0 * (1.0 - (kb))) * CS(full)),                 \
+	.ub = Q(0.5 * CS(full)),                                                \
+	.vr = Q(0.5 * CS(full)),                                                \
+	.vg = Q(-KG(kr, kb) / (2.0 * (1.0 - (kr))) * CS(full)),                 \
+	.vb = Q(-(kb) / (2.0 * (1.0 - (kr))) * CS(full)),                       \
+	.yoff = (full) ? 0 : 16,                                                \
+	/* yuv -> rgb: */                                                       \
+	.ky = Q(1.0 / YS(full)),                                                \
+	.rv = Q(2.0 * (1.0 - (kr)) / CS(full)),                                 \
+	.gu = Q(-2.0 * (kb) * (1.0 - (kb)) / KG(kr, kb) / CS(full)),            \
+	.gv = Q(-2.0 * (kr) * (1.0 - (kr)) / KG(kr, kb) / CS(full)),            \
+	.bu = Q(2.0 * (1.0 - (kb)) / CS(full)),                                 \
+}
+
+/* luma/chroma scale for limited vs full range: */
+#define YS(full)  ((full) ? 1.0 : (219.0 / 255.0))
+#define CS(full)  ((full) ? 1.0 : (224.0 / 255.0))
+
+static const struct color_conv convs[] = {
+		[COLOR_BT601]      = COLOR_CONV("bt601",      COLOR_BT601,      0.299,  0.114,  0),
+		[COLOR_BT709]      = COLOR_CONV("bt709",      COLOR_BT709,      0.2126, 0.0722, 0),
+		[COLOR_BT601_FULL] = COLOR_CONV("bt601-full", COLOR_BT601_FULL, 0.299,  0.114,  1),
+		[COLOR_BT709_FULL] = COLOR_CONV("bt709-full", COLOR_BT709_FULL, 0.2126, 0.0722, 1),
+};
+
+const struct color_conv *
+color_get(enum color_space cs)
+{
+	if ((unsigned)cs >= ARRAY_SIZE(convs))
+		cs = COLOR_BT601;
+	return &convs[cs];
+}
+
+int
+color_parse(const char *str, enum color_space *cs)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(convs); i++) {
+		if (!strcmp(str, convs[i].name)) {
+			*cs = convs[i].cs;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* The row kernels are written to be auto-vectorized: coefficients in
+ * locals, no aliasing, and branch-free clamping.
+ */
+
+static inline int32_t
+clamp8(int32_t v)
+{
+	return MIN(MAX(v, 0), 255);
+}
+
+void
+color_xrgb_to_yuv_row(const struct color_conv *cc,
+		const uint32_t *__restrict src, uint8_t *__restrict y,
+		uint8_t *__restrict u, uint8_t *__restrict v, int n)
+{
+	const int32_t yr = cc->yr, yg = cc->yg, yb = cc->yb;
+	const int32_t ur = cc->ur, ug = cc->ug, ub = cc->ub;
+	const int32_t vr = cc->vr, vg = cc->vg, vb = cc->vb;
+	const int32_t yoff = (cc->yoff << COLOR_SHIFT) + COLOR_HALF;
+	const int32_t coff = (128 << COLOR_SHIFT) + COLOR_HALF;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int32_t r = (src[i] >> 16) & 0xff;
+		int32_t g = (src[i] >> 8) & 0xff;
+		int32_t b = src[i] & 0xff;
+
+		y[i] = clamp8((yr * r + yg * g + yb * b + yoff) >> COLOR_SHIFT);
+		u[i] = clamp8((ur * r + ug * g + ub * b + coff) >> COLOR_SHIFT);
+		v[i] = clamp8((vr * r + vg * g + vb * b + coff) >> COLOR_SHIFT);
+	}
+}
+
+void
+color_yuv_to_xrgb_row(const struct color_conv *cc,
+		const uint8_t *__restrict y, const uint8_t *__restrict u,
+		const uint8_t *__restrict v, uint32_t *__restrict dst, int n)
+{
+	const int32_t ky = cc->ky, rv = cc->rv, gu = cc->gu, gv = cc->gv, bu = cc->bu;
+	const int32_t yoff = cc->yoff;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int32_t yy = ky * (y[i] - yoff) + COLOR_HALF;
+		int32_t uu = u[i] - 128;
+		int32_t vv = v[i] - 128;
+
+		int32_t r = clamp8((yy + rv * vv) >> COLOR_SHIFT);
+		int32_t g = clamp8((yy + gu * uu + gv * vv) >> COLOR_SHIFT);
+		int32_t b = clamp8((yy + bu * uu) >> COLOR_SHIFT);
+
+		dst[i] = 0xff000000 | (r << 16) | (g << 8) | b;
+	}
+}
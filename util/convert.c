@@ -0,0 +1,697 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <pthread.h>
+
+/* Software pixel format conversion, for when the display cannot scan out
+ * the format a source (ie. camera) produces.
+ *
+ * Every format is unpacked, two lines at a time, into unsubsampled (4:4:4)
+ * Y/U/V scratch lines, and then packed from there into the destination
+ * format.  So each format only needs an unpack and a pack function, rather
+ * than one function per pair of formats.  4:2:0 sources only unpack one
+ * chroma line and point both scratch lines at it.  The scratch lines stay
+ * in cache, and the loops are simple enough to be auto-vectorized.
+ *
+ * The conversion runs on its own thread, into a pool of destination
+ * buffers allocated from the display.
+ */
+
+struct conv_lines {
+	uint8_t *y[2], *u[2], *v[2];
+};
+
+struct conv_format {
+	uint32_t fourcc;
+	int subsampling;	/* 444, 422 or 420 */
+	void (*unpack)(const struct color_conv *cc, struct buffer *buf,
+			uint8_t **planes, int j, struct conv_lines *l);
+	void (*pack)(const struct color_conv *cc, struct buffer *buf,
+			uint8_t **planes, int j, struct conv_lines *l);
+};
+
+struct convert {
+	struct display *disp;
+	const struct conv_format *src_fmt, *dst_fmt;
+	uint32_t width, height;
+
+	struct buffer **bufs;
+	uint32_t nbufs;
+
+	/* source buffers to convert, converted buffers, and destination
+	 * buffers not in use:
+	 */
+	struct pool *in, *out, *free;
+
+	uint8_t *scratch;
+
+	pthread_t thread;
+	bool quit;
+
+	/* per-frame conversion cost, in usec: */
+	uint32_t frames;
+	double total, min, max;
+};
+
+/*
+ * Unpack:
+ */
+
+static void
+unpack_packed422(struct buffer *buf, uint8_t **planes, int j,
+		struct conv_lines *l, int yo, int uo, int vo)
+{
+	int r, i, w = buf->width / 2;
+
+	for (r = 0; r < 2; r++) {
+		const uint8_t *__restrict p = planes[0] + (j + r) * buf->pitches[0];
+		uint8_t *__restrict y = l->y[r], *__restrict u = l->u[r];
+		uint8_t *__restrict v = l->v[r];
+
+		for (i = 0; i < w; i++) {
+			y[2*i]   = p[4*i + yo];
+			y[2*i+1] = p[4*i + yo + 2];
+			u[2*i] = u[2*i+1] = p[4*i + uo];
+			v[2*i] = v[2*i+1] = p[4*i + vo];
+		}
+	}
+}
+
+static void
+unpack_yuyv(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	unpack_packed422(buf, planes, j, l, 0, 1, 3);
+}
+
+static void
+unpack_uyvy(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	unpack_packed422(buf, planes, j, l, 1, 0, 2);
+}
+
+static void
+unpack_planar420(struct buffer *buf, uint8_t **planes, int j,
+		struct conv_lines *l, const uint8_t *cu, const uint8_t *cv, int cs)
+{
+	uint8_t *__restrict u = l->u[0], *__restrict v = l->v[0];
+	int i, w = buf->width / 2;
+
+	memcpy(l->y[0], planes[0] + j * buf->pitches[0], buf->width);
+	memcpy(l->y[1], planes[0] + (j + 1) * buf->pitches[0], buf->width);
+
+	for (i = 0; i < w; i++) {
+		u[2*i] = u[2*i+1] = cu[i * cs];
+		v[2*i] = v[2*i+1] = cv[i * cs];
+	}
+
+	/* both lines share the same chroma: */
+	l->u[1] = l->u[0];
+	l->v[1] = l->v[0];
+}
+
+static void
+unpack_nv12(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	const uint8_t *c = planes[1] + (j / 2) * buf->pitches[1];
+	unpack_planar420(buf, planes, j, l, c, c + 1, 2);
+}
+
+static void
+unpack_i420(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	unpack_planar420(buf, planes, j, l,
+			planes[1] + (j / 2) * buf->pitches[1],
+			planes[2] + (j / 2) * buf->pitches[2], 1);
+}
+
+static void
+unpack_xrgb(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	int r;
+	for (r = 0; r < 2; r++) {
+		color_xrgb_to_yuv_row(cc,
+				(uint32_t *)(planes[0] + (j + r) * buf->pitches[0]),
+				l->y[r], l->u[r], l->v[r], buf->width);
+	}
+}
+
+/*
+ * Pack:
+ */
+
+static void
+pack_packed422(struct buffer *buf, uint8_t **planes, int j,
+		struct conv_lines *l, int yo, int uo, int vo)
+{
+	int r, i, w = buf->width / 2;
+
+	for (r = 0; r < 2; r++) {
+		uint8_t *__restrict p = planes[0] + (j + r) * buf->pitches[0];
+		const uint8_t *__restrict y = l->y[r], *__restrict u = l->u[r];
+		const uint8_t *__restrict v = l->v[r];
+
+		for (i = 0; i < w; i++) {
+			p[4*i + yo]     = y[2*i];
+			p[4*i + yo + 2] = y[2*i+1];
+			p[4*i + uo] = (u[2*i] + u[2*i+1] + 1) >> 1;
+			p[4*i + vo] = (v[2*i] + v[2*i+1] + 1) >> 1;
+		}
+	}
+}
+
+static void
+pack_yuyv(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	pack_packed422(buf, planes, j, l, 0, 1, 3);
+}
+
+static void
+pack_uyvy(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	pack_packed422(buf, planes, j, l, 1, 0, 2);
+}
+
+static void
+pack_planar420(struct buffer *buf, uint8_t **planes, int j,
+		struct conv_lines *l, uint8_t *cu, uint8_t *cv, int cs)
+{
+	const uint8_t *__restrict u0 = l->u[0], *__restrict u1 = l->u[1];
+	const uint8_t *__restrict v0 = l->v[0], *__restrict v1 = l->v[1];
+	int i, w = buf->width / 2;
+
+	memcpy(planes[0] + j * buf->pitches[0], l->y[0], buf->width);
+	memcpy(planes[0] + (j + 1) * buf->pitches[0], l->y[1], buf->width);
+
+	for (i = 0; i < w; i++) {
+		cu[i * cs] = (u0[2*i] + u0[2*i+1] + u1[2*i] + u1[2*i+1] + 2) >> 2;
+		cv[i * cs] = (v0[2*i] + v0[2*i+1] + v1[2*i] + v1[2*i+1] + 2) >> 2;
+	}
+}
+
+static void
+pack_nv12(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	uint8_t *c = planes[1] + (j / 2) * buf->pitches[1];
+	pack_planar420(buf, planes, j, l, c, c + 1, 2);
+}
+
+static void
+pack_i420(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	pack_planar420(buf, planes, j, l,
+			planes[1] + (j / 2) * buf->pitches[1],
+			planes[2] + (j / 2) * buf->pitches[2], 1);
+}
+
+static void
+pack_xrgb(const struct color_conv *cc, struct buffer *buf,
+		uint8_t **planes, int j, struct conv_lines *l)
+{
+	int r;
+	for (r = 0; r < 2; r++) {
+		color_yuv_to_xrgb_row(cc, l->y[r], l->u[r], l->v[r],
+				(uint32_t *)(planes[0] + (j + r) * buf->pitches[0]),
+				buf->width);
+	}
+}
+
+/* in order of preference, as a destination: */
+static const struct conv_format formats[] = {
+		{ FOURCC('N','V','1','2'), 420, unpack_nv12, pack_nv12 },
+		{ FOURCC('I','4','2','0'), 420, unpack_i420, pack_i420 },
+		{ FOURCC('Y','U','Y','V'), 422, unpack_yuyv, pack_yuyv },
+		{ FOURCC('U','Y','V','Y'), 422, unpack_uyvy, pack_uyvy },
+		{ 0,                       444, unpack_xrgb, pack_xrgb },
+};
+
+static const struct conv_format *
+find_format(uint32_t fourcc)
+{
+	unsigned int i;
+	for (i = 0; i < ARRAY_SIZE(formats); i++)
+		if (formats[i].fourcc == fourcc)
+			return &formats[i];
+	return NULL;
+}
+
+/* pick a destination format the display supports, preferring one with the
+ * same chroma subsampling (which is just a repack):
+ */
+static const struct conv_format *
+choose_format(struct display *disp, const struct conv_format *src)
+{
+	unsigned int i, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < ARRAY_SIZE(formats); i++) {
+			const struct conv_format *fmt = &formats[i];
+			if (fmt == src)
+				continue;
+			if (!pass && (fmt->subsampling != src->subsampling))
+				continue;
+			if (disp_supports_format(disp, fmt->fourcc))
+				return fmt;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+map_planes(struct buffer *buf, uint8_t **planes, uint32_t op)
+{
+	int i;
+	for (i = 0; i < fourcc_planes(buf->fourcc); i++)
+		planes[i] = buffer_plane(buf, i);
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_prep(buf->bo[i], op);
+}
+
+static void
+unmap_planes(struct buffer *buf, uint32_t op)
+{
+	int i;
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_fini(buf->bo[i], op);
+}
+
+static double
+now_us(void)
+{
+	return time_ns() / 1000.0;
+}
+
+static void
+convert_frame(struct convert *conv, struct buffer *src, struct buffer *dst)
+{
+	const struct color_conv *cc = color_get(src->colorspace);
+	uint8_t *sp[4], *dp[4];
+	struct conv_lines l;
+	uint32_t j, w = conv->width;
+
+	map_planes(src, sp, OMAP_GEM_READ);
+	map_planes(dst, dp, OMAP_GEM_WRITE);
+
+	for (j = 0; j < conv->height; j += 2) {
+		l.y[0] = conv->scratch;
+		l.y[1] = l.y[0] + w;
+		l.u[0] = l.y[1] + w;
+		l.u[1] = l.u[0] + w;
+		l.v[0] = l.u[1] + w;
+		l.v[1] = l.v[0] + w;
+
+		conv->src_fmt->unpack(cc, src, sp, j, &l);
+		conv->dst_fmt->pack(cc, dst, dp, j, &l);
+	}
+
+	unmap_planes(dst, OMAP_GEM_WRITE);
+	unmap_planes(src, OMAP_GEM_READ);
+
+	dst->colorspace = src->colorspace;
+}
+
+/* how often the thread checks for convert_close(), when idle: */
+#define POLL_MS 100
+
+static void *
+convert_thread(void *data)
+{
+	struct convert *conv = data;
+
+	while (!__atomic_load_n(&conv->quit, __ATOMIC_ACQUIRE)) {
+		struct buffer *src, *dst = NULL;
+		double t;
+
+		src = pool_get_timeout(conv->in, POLL_MS);
+		if (!src)
+			continue;
+
+		while (!dst && !__atomic_load_n(&conv->quit, __ATOMIC_ACQUIRE))
+			dst = pool_get_timeout(conv->free, POLL_MS);
+		if (!dst)
+			break;
+
+		TRACE_BEGIN("convert", dst);
+		t = now_us();
+		convert_frame(conv, src, dst);
+		t = now_us() - t;
+		TRACE_END("convert", dst);
+
+		DBG("convert: %.3f ms", t / 1000.0);
+
+		conv->frames++;
+		conv->total += t;
+		conv->min = conv->frames > 1 ? MIN(conv->min, t) : t;
+		conv->max = MAX(conv->max, t);
+
+		pool_put(conv->out, dst);
+	}
+
+	return NULL;
+}
+
+struct convert *
+convert_open(struct display *disp, uint32_t fourcc,
+		uint32_t width, uint32_t height, uint32_t n)
+{
+	struct convert *conv;
+	uint32_t i;
+	int ret;
+
+	conv = calloc(1, sizeof(*conv));
+	if (!conv) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+
+	conv->disp = disp;
+	conv->width = width;
+	conv->height = height;
+
+	if ((width | height) & 1) {
+		ERROR("odd dimensions not supported: %ux%u", width, height);
+		goto fail;
+	}
+
+	conv->src_fmt = find_format(fourcc);
+	if (!conv->src_fmt) {
+		ERROR("no conversion from format: %.4s", (char *)&fourcc);
+		goto fail;
+	}
+
+	conv->dst_fmt = choose_format(disp, conv->src_fmt);
+	if (!conv->dst_fmt) {
+		ERROR("no supported format to convert %.4s to", (char *)&fourcc);
+		goto fail;
+	}
+
+	/* straight from the backend, to keep them out of the disp_get_vid_buffer()
+	 * pool:
+	 */
+	conv->bufs = disp->get_vid_buffers(disp, n, conv->dst_fmt->fourcc,
+			width, height);
+	conv->nbufs = n;
+	conv->in = pool_new(n);
+	conv->out = pool_new(n);
+	conv->free = pool_new(n);
+	conv->scratch = malloc(6 * width);
+	if (!conv->bufs || !conv->in || !conv->out || !conv->free ||
+			!conv->scratch) {
+		ERROR("allocation failed");
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++)
+		pool_put(conv->free, conv->bufs[i]);
+
+	ret = pthread_create(&conv->thread, NULL, convert_thread, conv);
+	if (ret) {
+		ERROR("could not create convert thread: %s", strerror(ret));
+		goto fail;
+	}
+
+	MSG("Converting %.4s to %.4s for display", (char *)&fourcc,
+			conv->dst_fmt->fourcc ? (char *)&conv->dst_fmt->fourcc : "RGB4");
+
+	return conv;
+
+fail:
+	free(conv->scratch);
+	pool_free(conv->free);
+	pool_free(conv->out);
+	pool_free(conv->in);
+	disp_free_buffers(disp, conv->bufs, conv->nbufs);
+	free(conv);
+	return NULL;
+}
+
+void
+convert_close(struct convert *conv)
+{
+	if (!conv)
+		return;
+
+	__atomic_store_n(&conv->quit, true, __ATOMIC_RELEASE);
+	pthread_join(conv->thread, NULL);
+
+	if (conv->frames) {
+		uint32_t fourcc = conv->src_fmt->fourcc;
+		MSG("convert %.4s->%.4s %ux%u: %u frames, %.3f ms/frame "
+				"(min %.3f, max %.3f)",
+				(char *)&fourcc,
+				conv->dst_fmt->fourcc ? (char *)&conv->dst_fmt->fourcc : "RGB4",
+				conv->width, conv->height, conv->frames,
+				conv->total / conv->frames / 1000.0,
+				conv->min / 1000.0, conv->max / 1000.0);
+	}
+
+	free(conv->scratch);
+	pool_free(conv->free);
+	pool_free(conv->out);
+	pool_free(conv->in);
+	disp_free_buffers(conv->disp, conv->bufs, conv->nbufs);
+	free(conv);
+}
+
+uint32_t
+convert_fourcc(struct convert *conv)
+{
+	return conv->dst_fmt->fourcc;
+}
+
+int
+convert_queue(struct convert *conv, struct buffer *src)
+{
+	if (!pool_put(conv->in, src)) {
+		ERROR("too many buffers queued for conversion");
+		return -1;
+	}
+	return 0;
+}
+
+struct buffer *
+convert_dequeue(struct convert *conv)
+{
+	return pool_get_timeout(conv->out, -1);
+}
+
+void
+convert_put(struct convert *conv, struct buffer *dst)
+{
+	pool_put(conv->free, dst);
+}
+
+int
+convert_blit(struct buffer *src, uint32_t sx, uint32_t sy,
+		uint32_t sw, uint32_t sh, struct buffer *dst,
+		uint32_t dx, uint32_t dy, uint32_t dw, uint32_t dh)
+{
+	const struct conv_format *fmt = find_format(src->fourcc);
+	const struct color_conv *cc = color_get(src->colorspace);
+	uint8_t *sp[4], *dp[4], *scratch, *y, *u, *v;
+	struct conv_lines l;
+	uint32_t i, j, w = src->width, line = ~0;
+
+	if (!fmt || (dst->fourcc && (dst->fourcc != FOURCC('A','R','2','4'))))
+		return -1;
+
+	/* clip, the rest is already in range: */
+	if ((sx + sw > src->width) || (sy + sh > src->height) ||
+			(dx >= dst->width) || (dy >= dst->height) || !sw || !sh)
+		return -1;
+	dw = MIN(dw, dst->width - dx);
+	dh = MIN(dh, dst->height - dy);
+
+	/* two unpacked source lines, and one scaled line: */
+	scratch = malloc((6 * w) + (3 * dw));
+	if (!scratch) {
+		ERROR("allocation failed");
+		return -1;
+	}
+	y = scratch + (6 * w);
+	u = y + dw;
+	v = u + dw;
+
+	map_planes(src, sp, OMAP_GEM_READ);
+	map_planes(dst, dp, OMAP_GEM_WRITE);
+
+	for (j = 0; j < dh; j++) {
+		uint32_t sj = sy + (j * sh / dh), r = sj & 1;
+
+		/* unpack works on pairs of lines: */
+		if ((sj & ~1) != line) {
+			line = sj & ~1;
+			l.y[0] = scratch;
+			l.y[1] = l.y[0] + w;
+			l.u[0] = l.y[1] + w;
+			l.u[1] = l.u[0] + w;
+			l.v[0] = l.u[1] + w;
+			l.v[1] = l.v[0] + w;
+			fmt->unpack(cc, src, sp, line, &l);
+		}
+
+		for (i = 0; i < dw; i++) {
+			uint32_t si = sx + (i * sw / dw);
+			y[i] = l.y[r][si];
+			u[i] = l.u[r][si];
+			v[i] = l.v[r][si];
+		}
+
+		color_yuv_to_xrgb_row(cc, y, u, v,
+				(uint32_t *)(dp[0] + (dy + j) * dst->pitches[0]) + dx, dw);
+	}
+
+	unmap_planes(dst, OMAP_GEM_WRITE);
+	unmap_planes(src, OMAP_GEM_READ);
+
+	free(scratch);
+
+	return 0;
+}
+
+/* rotate a w x h plane of bpp byte pixels counter-clockwise, like the
+ * DRM_MODE_ROTATE_* rotations.  The destination is usually write-combined,
+ * so it is written in order, and the source is read along its columns:
+ */
+static void
+rotate_plane(const uint8_t *src, uint32_t spitch, uint8_t *dst,
+		uint32_t dpitch, uint32_t w, uint32_t h, uint32_t bpp,
+		uint32_t degrees)
+{
+	uint32_t dw = (degrees % 180) ? h : w;
+	uint32_t dh = (degrees % 180) ? w : h;
+	uint32_t i, j;
+
+	for (j = 0; j < dh; j++, dst += dpitch) {
+		const uint8_t *s;
+		int32_t step;
+
+		/* the source pixel of the first pixel of the line, and the
+		 * offset to the next one:
+		 */
+		switch (degrees) {
+		case 90:
+			s = src + (w - 1 - j) * bpp;
+			step = spitch;
+			break;
+		case 180:
+			s = src + (h - 1 - j) * spitch + (w - 1) * bpp;
+			step = -(int32_t)bpp;
+			break;
+		case 270:
+			s = src + (h - 1) * spitch + j * bpp;
+			step = -(int32_t)spitch;
+			break;
+		default:
+			memcpy(dst, src + j * spitch, w * bpp);
+			continue;
+		}
+
+		switch (bpp) {
+		case 1:
+			for (i = 0; i < dw; i++, s += step)
+				dst[i] = *s;
+			break;
+		case 2:
+			for (i = 0; i < dw; i++, s += step)
+				((uint16_t *)dst)[i] = *(const uint16_t *)s;
+			break;
+		default:
+			for (i = 0; i < dw; i++, s += step)
+				((uint32_t *)dst)[i] = *(const uint32_t *)s;
+			break;
+		}
+	}
+}
+
+int
+convert_rotate(struct buffer *src, uint32_t sx, uint32_t sy,
+		uint32_t sw, uint32_t sh, struct buffer *dst, uint32_t degrees)
+{
+	uint8_t *sp[4], *dp[4];
+	uint32_t bpp[3], sub[3];
+	int i, n;
+
+	switch (src->fourcc) {
+	case 0:
+	case FOURCC('A','R','2','4'):
+		n = 1;
+		bpp[0] = 4;
+		sub[0] = 1;
+		break;
+	case FOURCC('N','V','1','2'):
+		n = 2;
+		bpp[0] = 1;
+		bpp[1] = 2;
+		sub[0] = 1;
+		sub[1] = 2;
+		break;
+	case FOURCC('I','4','2','0'):
+		n = 3;
+		bpp[0] = bpp[1] = bpp[2] = 1;
+		sub[0] = 1;
+		sub[1] = sub[2] = 2;
+		break;
+	default:
+		/* packed 4:2:2 shares chroma between horizontal neighbours,
+		 * which are vertical ones once rotated:
+		 */
+		return -1;
+	}
+
+	if ((dst->fourcc != src->fourcc) || (degrees % 90) || (degrees >= 360))
+		return -1;
+	if ((n > 1) && ((sx | sy | sw | sh) & 1))
+		return -1;
+	if ((sx + sw > src->width) || (sy + sh > src->height) || !sw || !sh)
+		return -1;
+	if ((degrees % 180) ? ((sh > dst->width) || (sw > dst->height)) :
+			((sw > dst->width) || (sh > dst->height)))
+		return -1;
+
+	map_planes(src, sp, OMAP_GEM_READ);
+	map_planes(dst, dp, OMAP_GEM_WRITE);
+
+	for (i = 0; i < n; i++) {
+		rotate_plane(sp[i] + (sy / sub[i]) * src->pitches[i] +
+				(sx / sub[i]) * bpp[i], src->pitches[i],
+				dp[i], dst->pitches[i], sw / sub[i], sh / sub[i],
+				bpp[i], degrees);
+	}
+
+	unmap_planes(dst, OMAP_GEM_WRITE);
+	unmap_planes(src, OMAP_GEM_READ);
+
+	dst->colorspace = src->colorspace;
+
+	return 0;
+}
@@ -38,6 +38,7 @@
 #include <libavcodec/avcodec.h>
 
 #include "util.h"
+#include "demux.h"
 
 struct demux {
 	AVFormatContext *afc;
@@ -123,15 +124,22 @@ struct demux * demux_init(const char * filename, int *width, int *height)
 	return open_stream(filename, width, height);
 }
 
-int demux_read(struct demux *demux, char *input, int size)
+int demux_read(struct demux *demux, char *input, int size, int64_t *pts)
 {
 	AVPacket pk = {};
 
+	*pts = DEMUX_NOPTS;
+
 	while (!av_read_frame(demux->afc, &pk)) {
 		if (pk.stream_index == demux->st->index) {
+			static const AVRational ns = { 1, 1000000000 };
+			int64_t ts = (pk.pts != AV_NOPTS_VALUE) ? pk.pts : pk.dts;
 			uint8_t *buf;
 			int bufsize;
 
+			if (ts != AV_NOPTS_VALUE)
+				*pts = av_rescale_q(ts, demux->st->time_base, ns);
+
 			if (demux->bsf) {
 				int ret;
 				ret = av_bitstream_filter_filter(demux->bsf, demux->cc,
@@ -35,8 +35,12 @@
 
 struct demux;
 
+/* pts of a packet without a timestamp */
+#define DEMUX_NOPTS INT64_MIN
+
 struct demux * demux_init(const char * filename, int *width, int *height);
-int demux_read(struct demux *demux, char *input, int size);
+/* returns the size of the packet, and its pts in ns (or DEMUX_NOPTS) */
+int demux_read(struct demux *demux, char *input, int size, int64_t *pts);
 int demux_rewind(struct demux *demux);
 void demux_deinit(struct demux *demux);
 
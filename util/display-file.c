@@ -0,0 +1,575 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* for memfd_create(): */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+ * Headless display, for benchmarks and CI on machines without a display (or
+ * without omapdrm at all).  The buffers are in system memory, a memfd each,
+ * and posting them does nothing, or with --file, copies the frames into a
+ * preallocated and memory mapped file, as Y4M (if the name ends in .y4m) or
+ * raw frames.
+ */
+
+/* default size of the display, and number of frames the file has room for: */
+#define WIDTH	1920
+#define HEIGHT	1080
+#define FRAMES	300
+
+#define Y4M_FRAME "FRAME\n"
+
+#define to_display_file(x) container_of(x, struct display_file, base)
+struct display_file {
+	struct display base;
+
+	/* every buffer allocated and not yet freed, to free them on close: */
+	struct list buffers;
+
+	/* with --file, the frames are all of the format and size of the
+	 * first one.  Once a video frame is posted, only video frames are
+	 * written (and the UI frames written until then are dropped):
+	 */
+	const char *path;
+	bool want_y4m;		/* the name ends in .y4m */
+	bool y4m, video;	/* of the file as it is now */
+	int fd;
+	uint8_t *map;
+	size_t header_size, frame_size, map_size;
+	uint32_t fourcc, width, height;
+	uint32_t max_frames, frames, skipped, full;
+	struct hist *write_hist;
+};
+
+#define to_buffer_file(x) container_of(x, struct buffer_file, base)
+struct buffer_file {
+	struct buffer base;
+	int memfd;
+	struct list link;	/* in display_file::buffers */
+};
+
+static bool
+is_420(uint32_t fourcc)
+{
+	return (fourcc == FOURCC('N','V','1','2')) ||
+			(fourcc == FOURCC('I','4','2','0'));
+}
+
+/* where the x,y,w,h rect of a frame is in plane i of the format, in bytes
+ * and rows.  Returns false past the last plane:
+ */
+static bool
+plane_rect(uint32_t fourcc, int i, uint32_t x, uint32_t y, uint32_t w,
+		uint32_t h, uint32_t *bx, uint32_t *by, uint32_t *bw, uint32_t *bh)
+{
+	if (i >= fourcc_planes(fourcc))
+		return false;
+
+	switch (fourcc) {
+	case FOURCC('U','Y','V','Y'):
+	case FOURCC('Y','U','Y','V'):
+		*bx = x * 2;
+		*bw = w * 2;
+		break;
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'):
+		/* chroma is subsampled by two both ways: */
+		if (i == 0) {
+			*bx = x;
+			*bw = w;
+			break;
+		}
+		*bx = (fourcc == FOURCC('N','V','1','2')) ? x : x / 2;
+		*bw = (fourcc == FOURCC('N','V','1','2')) ? w : w / 2;
+		*by = y / 2;
+		*bh = h / 2;
+		return true;
+	default:
+		*bx = x * 4;
+		*bw = w * 4;
+		break;
+	}
+
+	*by = y;
+	*bh = h;
+
+	return true;
+}
+
+/* bytes of a w x h frame in the file: */
+static size_t
+frame_size(uint32_t fourcc, uint32_t w, uint32_t h, bool y4m)
+{
+	uint32_t i, bx, by, bw, bh;
+	size_t size = 0;
+
+	if (y4m)
+		return strlen(Y4M_FRAME) + (w * h) + 2 * ((w / 2) * (h / 2));
+
+	for (i = 0; plane_rect(fourcc, i, 0, 0, w, h, &bx, &by, &bw, &bh); i++)
+		size += bw * bh;
+
+	return size;
+}
+
+static void
+close_file(struct display *disp)
+{
+	struct display_file *disp_file = to_display_file(disp);
+
+	if (disp_file->map) {
+		munmap(disp_file->map, disp_file->map_size);
+		disp_file->map = NULL;
+	}
+
+	if (disp_file->fd >= 0) {
+		/* cut off the room which was not used: */
+		if (ftruncate(disp_file->fd, disp_file->header_size +
+				disp_file->frames * disp_file->frame_size))
+			ERROR("could not truncate %s: %s", disp_file->path,
+					strerror(errno));
+		close(disp_file->fd);
+		disp_file->fd = -1;
+	}
+}
+
+/* (re)create the file for frames of the format and size: */
+static int
+open_file(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
+{
+	struct display_file *disp_file = to_display_file(disp);
+	struct rate_control *p = &disp->rtctl;
+	char header[128];
+	int ret;
+
+	close_file(disp);
+
+	disp_file->fourcc = fourcc;
+	disp_file->width = w;
+	disp_file->height = h;
+	disp_file->frames = 0;
+	disp_file->header_size = 0;
+	disp_file->y4m = disp_file->want_y4m && is_420(fourcc);
+
+	if (disp_file->y4m) {
+		/* y4m needs a frame rate, the stream's is not known here: */
+		disp_file->header_size = snprintf(header, sizeof(header),
+				"YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C420jpeg\n", w, h,
+				p->fps_num ? p->fps_num : 30, p->fps_num ? p->fps_den : 1);
+	}
+
+	disp_file->frame_size = frame_size(fourcc, w, h, disp_file->y4m);
+	disp_file->map_size = disp_file->header_size +
+			disp_file->max_frames * disp_file->frame_size;
+
+	disp_file->fd = open(disp_file->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (disp_file->fd < 0) {
+		ERROR("could not open %s: %s", disp_file->path, strerror(errno));
+		return -1;
+	}
+
+	/* allocate all of it now, so that writing the frames does not: */
+	ret = posix_fallocate(disp_file->fd, 0, disp_file->map_size);
+	if (ret) {
+		ERROR("could not allocate %zu bytes for %s: %s",
+				disp_file->map_size, disp_file->path, strerror(ret));
+		goto fail;
+	}
+
+	disp_file->map = mmap(NULL, disp_file->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, disp_file->fd, 0);
+	if (disp_file->map == MAP_FAILED) {
+		disp_file->map = NULL;
+		ERROR("could not map %s: %s", disp_file->path, strerror(errno));
+		goto fail;
+	}
+
+	memcpy(disp_file->map, header, disp_file->header_size);
+
+	MSG("writing %s frames of %ux%u %.4s to %s, room for %u",
+			disp_file->y4m ? "y4m" : "raw", w, h,
+			fourcc ? (char *)&fourcc : "RGB4", disp_file->path,
+			disp_file->max_frames);
+
+	return 0;
+
+fail:
+	close_file(disp);
+	return -1;
+}
+
+static void
+write_frame(struct display *disp, struct buffer *buf, bool video,
+		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	struct display_file *disp_file = to_display_file(disp);
+	uint32_t i, j, k, bx, by, bw, bh;
+	uint64_t t = time_ns();
+	uint8_t *dst;
+
+	if (!disp_file->path)
+		return;
+
+	/* the first video frame starts over, UI frames are dropped after: */
+	if (!video && disp_file->video)
+		return;
+
+	/* subsampled chroma needs an even rect: */
+	if (is_420(buf->fourcc)) {
+		x &= ~1;
+		y &= ~1;
+		w &= ~1;
+		h &= ~1;
+	}
+
+	if ((video && !disp_file->video) || !disp_file->map) {
+		disp_file->video = video;
+		if (open_file(disp, buf->fourcc, w, h)) {
+			/* do not try again every frame: */
+			disp_file->path = NULL;
+			return;
+		}
+	}
+
+	if ((buf->fourcc != disp_file->fourcc) || (w != disp_file->width) ||
+			(h != disp_file->height)) {
+		disp_file->skipped++;
+		return;
+	}
+
+	if (disp_file->frames == disp_file->max_frames) {
+		disp_file->full++;
+		return;
+	}
+
+	TRACE_BEGIN("file write", buf);
+
+	dst = disp_file->map + disp_file->header_size +
+			disp_file->frames * disp_file->frame_size;
+
+	if (disp_file->y4m) {
+		memcpy(dst, Y4M_FRAME, strlen(Y4M_FRAME));
+		dst += strlen(Y4M_FRAME);
+	}
+
+	for (i = 0; plane_rect(buf->fourcc, i, x, y, w, h, &bx, &by, &bw, &bh); i++) {
+		uint8_t *src = (uint8_t *)buffer_plane(buf, i) +
+				by * buf->pitches[i] + bx;
+
+		if (disp_file->y4m && (buf->fourcc == FOURCC('N','V','1','2')) &&
+				(i == 1)) {
+			/* y4m has planar chroma, U then V: */
+			uint8_t *u = dst, *v = dst + (bw / 2) * bh;
+			for (j = 0; j < bh; j++, src += buf->pitches[i]) {
+				for (k = 0; k < bw / 2; k++) {
+					*u++ = src[2 * k];
+					*v++ = src[2 * k + 1];
+				}
+			}
+			dst += bw * bh;
+			continue;
+		}
+
+		for (j = 0; j < bh; j++, src += buf->pitches[i], dst += bw)
+			memcpy(dst, src, bw);
+	}
+
+	disp_file->frames++;
+
+	TRACE_END("file write", buf);
+	hist_record(disp_file->write_hist, time_ns() - t);
+}
+
+static void
+free_buffer(struct display *disp, struct buffer *buf)
+{
+	struct buffer_file *buf_file = to_buffer_file(buf);
+
+	list_del(&buf_file->link);
+
+	if (buf->map)
+		munmap(buf->map, buf->size);
+	if (buf_file->memfd >= 0)
+		close(buf_file->memfd);
+
+	free(buf_file);
+}
+
+static struct buffer *
+alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
+{
+	struct display_file *disp_file = to_display_file(disp);
+	struct buffer_file *buf_file;
+	struct buffer *buf;
+	uint32_t i, bx, by, bw, bh;
+
+	buf_file = calloc(1, sizeof(*buf_file));
+	if (!buf_file) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+	buf = &buf_file->base;
+	list_add(&buf_file->link, &disp_file->buffers);
+
+	buf->fourcc = fourcc;
+	buf->width = w;
+	buf->height = h;
+	buf->acquire_fence = -1;
+	buf_file->memfd = -1;
+
+	switch (fourcc) {
+	case 0:
+	case FOURCC('A','R','2','4'):
+	case FOURCC('U','Y','V','Y'):
+	case FOURCC('Y','U','Y','V'):
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'):
+		break;
+	default:
+		ERROR("invalid format: 0x%08x", fourcc);
+		goto fail;
+	}
+
+	/* all the planes, one after the other, in one memfd: */
+	for (i = 0; plane_rect(fourcc, i, 0, 0, w, h, &bx, &by, &bw, &bh); i++) {
+		buf->pitches[i] = bw;
+		buf->offsets[i] = buf->size;
+		buf->size += bw * bh;
+	}
+
+	buf_file->memfd = memfd_create("buffer", MFD_CLOEXEC);
+	if (buf_file->memfd < 0) {
+		ERROR("memfd_create failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (ftruncate(buf_file->memfd, buf->size)) {
+		ERROR("could not allocate %u bytes: %s", buf->size, strerror(errno));
+		goto fail;
+	}
+
+	buf->map = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			buf_file->memfd, 0);
+	if (buf->map == MAP_FAILED) {
+		buf->map = NULL;
+		ERROR("mmap failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	return buf;
+
+fail:
+	free_buffer(disp, buf);
+	return NULL;
+}
+
+static void
+free_buffers(struct display *disp, struct buffer **bufs, uint32_t n)
+{
+	uint32_t i;
+
+	if (!bufs)
+		return;
+
+	for (i = 0; i < n; i++)
+		if (bufs[i])
+			free_buffer(disp, bufs[i]);
+
+	free(bufs);
+}
+
+static struct buffer **
+get_vid_buffers(struct display *disp, uint32_t n,
+		uint32_t fourcc, uint32_t w, uint32_t h)
+{
+	struct buffer **bufs;
+	uint32_t i;
+
+	bufs = calloc(n, sizeof(*bufs));
+	if (!bufs) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		bufs[i] = alloc_buffer(disp, fourcc, w, h);
+		if (!bufs[i]) {
+			free_buffers(disp, bufs, n);
+			return NULL;
+		}
+	}
+
+	return bufs;
+}
+
+static struct buffer **
+get_buffers(struct display *disp, uint32_t n)
+{
+	return get_vid_buffers(disp, n, 0, disp->width, disp->height);
+}
+
+static int
+post_buffer(struct display *disp, struct buffer *buf)
+{
+	write_frame(disp, buf, false, 0, 0, buf->width, buf->height);
+	return 0;
+}
+
+static int
+post_vid_buffer(struct display *disp, struct buffer *buf,
+		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	write_frame(disp, buf, true, x, y,
+			MIN(w, buf->width - MIN(x, buf->width)),
+			MIN(h, buf->height - MIN(y, buf->height)));
+	return 0;
+}
+
+static bool
+supports_format(struct display *disp, uint32_t fourcc)
+{
+	switch (fourcc) {
+	case FOURCC('A','R','2','4'):
+	case FOURCC('U','Y','V','Y'):
+	case FOURCC('Y','U','Y','V'):
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'):
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void
+close_file_display(struct display *disp)
+{
+	struct display_file *disp_file = to_display_file(disp);
+	struct buffer_file *buf_file, *tmp;
+
+	if (disp_file->map)
+		MSG("wrote %u frames to %s, %u skipped (of another size), "
+				"%u not written (file full)", disp_file->frames,
+				disp_file->path, disp_file->skipped, disp_file->full);
+
+	close_file(disp);
+
+	list_for_each_entry_safe(buf_file, tmp, &disp_file->buffers, link)
+		free_buffer(disp, &buf_file->base);
+
+	free(disp_file);
+}
+
+void
+disp_file_usage(void)
+{
+	MSG("File (headless) Display Options:");
+	MSG("\t--null\tEnable the headless display, buffers are in system memory");
+	MSG("\t--file <path>\tsame, and write the frames to <path>, as Y4M if it ends in .y4m");
+	MSG("\t--file-frames <n>\troom for n frames in the file, allocated up front (default %d)", FRAMES);
+	MSG("\t--file-size <width>x<height>\tsize of the display (default %dx%d)", WIDTH, HEIGHT);
+}
+
+struct display *
+disp_file_open(int argc, char **argv)
+{
+	struct display_file *disp_file = NULL;
+	struct display *disp;
+	uint32_t width = WIDTH, height = HEIGHT, frames = FRAMES;
+	const char *path = NULL;
+	int i, enabled = 0;
+
+	/* note: set args to NULL after we've parsed them so other modules know
+	 * that it is already parsed (since the arg parsing is decentralized)
+	 */
+	for (i = 1; i < argc; i++) {
+		if (!argv[i]) {
+			continue;
+		}
+		if (!strcmp("--null", argv[i])) {
+			enabled = 1;
+		} else if (!strcmp("--file", argv[i])) {
+			argv[i++] = NULL;
+			path = argv[i];
+			enabled = 1;
+		} else if (!strcmp("--file-frames", argv[i])) {
+			argv[i++] = NULL;
+			if ((sscanf(argv[i], "%u", &frames) != 1) || !frames) {
+				ERROR("invalid arg: %s", argv[i]);
+				return NULL;
+			}
+		} else if (!strcmp("--file-size", argv[i])) {
+			argv[i++] = NULL;
+			if ((sscanf(argv[i], "%ux%u", &width, &height) != 2) ||
+					!width || !height) {
+				ERROR("invalid arg: %s", argv[i]);
+				return NULL;
+			}
+		} else {
+			/* ignore */
+			continue;
+		}
+		argv[i] = NULL;
+	}
+
+	/* If not explicitly enabled from command line, fall back to the others: */
+	if (!enabled)
+		return NULL;
+
+	disp_file = calloc(1, sizeof(*disp_file));
+	if (!disp_file) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+	disp = &disp_file->base;
+
+	list_init(&disp_file->buffers);
+	disp_file->fd = -1;
+	disp_file->path = path;
+	disp_file->max_frames = frames;
+	disp_file->write_hist = hist_get("file write");
+	if (path) {
+		const char *ext = strrchr(path, '.');
+		disp_file->want_y4m = ext && !strcmp(ext, ".y4m");
+	}
+
+	/* no drm device: */
+	disp->fd = -1;
+	disp->width = width;
+	disp->height = height;
+	disp->multiplanar = false;
+
+	disp->get_buffers = get_buffers;
+	disp->get_vid_buffers = get_vid_buffers;
+	disp->post_buffer = post_buffer;
+	disp->post_vid_buffer = post_vid_buffer;
+	disp->close = close_file_display;
+	disp->supports_format = supports_format;
+	disp->free_buffers = free_buffers;
+
+	MSG("using headless %dx%d display", disp->width, disp->height);
+
+	return disp;
+}
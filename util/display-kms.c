@@ -21,6 +21,10 @@
 
 #include "util.h"
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <xf86drmMode.h>
 
 
@@ -36,10 +40,26 @@
 struct connector {
 	uint32_t id;
 	char mode_str[64];
+	drmModeConnector *connector;	/* which the mode points into */
 	drmModeModeInfo *mode;
 	drmModeEncoder *encoder;
 	int crtc;
 	int pipe;
+	uint32_t x;		/* of its part of the side-by-side virtual display */
+
+	struct display *disp;
+	/* on screen, being flipped to, and to be flipped to next: */
+	struct buffer *shown, *flipping, *queued;
+	struct buffer *vid;	/* on the overlay, with legacy planes */
+	bool pending;		/* a flip (or atomic commit) is in flight */
+	uint64_t flip_t;	/* when it was queued */
+	/* vblanks the flip in flight and the queued one were scheduled for: */
+	uint32_t flip_target, queued_target;
+
+	/* with --atomic: */
+	uint32_t primary_id;	/* primary plane */
+	uint32_t mode_blob;
+	int out_fence;		/* of the last commit, until it is handed out */
 };
 
 #define to_display_kms(x) container_of(x, struct display_kms, base)
@@ -49,23 +69,305 @@ struct display_kms {
 	uint32_t connectors_count;
 	struct connector connector[10];
 	drmModePlane *ovr[10];
+	bool composite[10];	/* no overlay left, the video is composited */
+
+	/* every display in the process, which are the streams of a mosaic
+	 * once they have video buffers:
+	 */
+	struct list link;
+	bool stream;
+	bool window;		/* --window given, else a cell of the grid */
+	uint32_t win_x, win_y, win_w, win_h;
+
+	/* --rotate, counter-clockwise in degrees.  When a plane can't rotate
+	 * (or the video is composited), the frames are rotated by the cpu
+	 * into rot_bufs, which are posted instead:
+	 */
+	uint32_t rotation;
+	bool rotation_checked, cpu_rotate;
+	uint32_t rot_prop[10];
+	struct buffer **rot_bufs;
+	uint32_t rot_idx;
+	struct hist *rotate_hist;
 
 	int scheduled_flips, completed_flips;
+	struct hist *flip_hist;		/* page flip to completion */
+	int vblank_pipe;
 	uint32_t bo_flags;
+	bool single_bo;		/* all planes of a video buffer in one bo */
+	bool dumb;		/* generic dumb buffers rather than omap bo's */
 	drmModeResPtr resources;
 	drmModePlaneRes *plane_resources;
 	struct buffer *current;
+
+	/* with --atomic, the state which is committed, and the property ids
+	 * (which are the same for every object of a type):
+	 */
+	bool atomic, active, primary_dirty;
+	struct buffer *vid;
+	struct buffer *vid_retired;	/* taken off screen by the commit in flight */
+	uint32_t vid_x, vid_y, vid_w, vid_h;
+	struct {
+		uint32_t conn_crtc_id, crtc_mode_id, crtc_active, crtc_out_fence_ptr;
+		uint32_t fb_id, crtc_id, src_x, src_y, src_w, src_h;
+		uint32_t crtc_x, crtc_y, crtc_w, crtc_h, in_fence_fd;
+	} prop;
+
+	/* every buffer allocated, and not yet really freed, so that they are
+	 * all freed on close, even the ones the app did not give back:
+	 */
+	struct list buffers;
+
+	/* freed buffers, most recently freed first, and the ones freed while
+	 * still on screen, which are cached once they are off it:
+	 */
+	struct list cache, deferred;
+	uint64_t cache_bytes, cache_max;
+	uint32_t cache_hits, cache_misses, cache_evictions;
 };
 
+/* default size limit of the buffer cache, in MiB: */
+#define CACHE_MAX 32
+
+/* buffers the cpu rotates frames into, one is on screen, one may be in a
+ * flip, and the next one is written:
+ */
+#define NROT 3
+
 #define to_buffer_kms(x) container_of(x, struct buffer_kms, base)
 struct buffer_kms {
 	struct buffer base;
 	uint32_t fb_id;
+	uint32_t handle;	/* of the dumb buffer, which has no bo */
+
+	/* cache key (the fourcc, width and height are in base), and the
+	 * total size of the bo's:
+	 */
+	enum mem_purpose purpose;
+	uint32_t bo_flags;
+	uint32_t size;
+	struct list cache;
+	struct list link;	/* in display_kms::buffers */
+
+	int scanout_refs;	/* crtcs showing, flipping to or queueing it */
+	bool internal;		/* rotated into by the cpu, not the app's */
+	bool deferred;		/* freed while on screen */
+
+	/* with --atomic, the out fences of the commit which took the buffer
+	 * off screen:
+	 */
+	int release_fence[10];
+	uint32_t nrelease;
 };
 
+/*
+ * Mosaic:
+ *
+ * Apps like viddec3test open a display per stream.  These share the drm fd
+ * (only the drm master may set planes), and each stream gets overlays of
+ * its own, which show it in a cell of a grid on every connector, or in the
+ * window given with --window.  A stream for which no overlay is left is
+ * scaled into the buffer the primary plane shows by the cpu instead.
+ */
+
+#define MAX_PLANES 32
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list displays = { &displays, &displays };
+static int shared_fd = -1, shared_fd_refs;
+static uint32_t claimed[MAX_PLANES], nclaimed;
+static uint32_t grid_cols, grid_rows;	/* 0 for a grid to fit the streams */
+
+/* what the primary plane of each crtc shows, to composite into: */
+static struct {
+	int crtc;
+	struct buffer *buf;
+	uint32_t x;
+} primaries[10];
+
+/* without omapdrm, the first device which can do modesetting (vkms, or
+ * the driver of a desktop gpu), with dumb buffers:
+ */
+static int
+open_any_kms(void)
+{
+	char path[32];
+	int i, fd;
+
+	for (i = 0; i < 16; i++) {
+		drmModeResPtr res;
+
+		snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		res = drmModeGetResources(fd);
+		if (res && res->count_crtcs && res->count_connectors) {
+			drmModeFreeResources(res);
+			MSG("omapdrm not found, using %s", path);
+			return fd;
+		}
+
+		if (res)
+			drmModeFreeResources(res);
+		close(fd);
+	}
+
+	return -1;
+}
+
+static bool
+is_omapdrm(int fd)
+{
+	drmVersionPtr version = drmGetVersion(fd);
+	bool ret = version && !strcmp(version->name, "omapdrm");
+
+	drmFreeVersion(version);
+
+	return ret;
+}
+
+static int
+get_shared_fd(void)
+{
+	int fd;
+
+	pthread_mutex_lock(&lock);
+	if (!shared_fd_refs) {
+		shared_fd = drmOpen("omapdrm", NULL);
+		if (shared_fd < 0)
+			shared_fd = open_any_kms();
+	}
+	if (shared_fd >= 0)
+		shared_fd_refs++;
+	fd = shared_fd;
+	pthread_mutex_unlock(&lock);
+
+	return fd;
+}
+
+static void
+put_shared_fd(void)
+{
+	pthread_mutex_lock(&lock);
+	if (!--shared_fd_refs) {
+		drmClose(shared_fd);
+		shared_fd = -1;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* call with the lock held: */
+static bool
+plane_claimed(uint32_t plane_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < nclaimed; i++)
+		if (claimed[i] == plane_id)
+			return true;
+
+	return false;
+}
+
+static void
+unclaim_plane(uint32_t plane_id)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nclaimed; i++) {
+		if (claimed[i] == plane_id) {
+			claimed[i] = claimed[--nclaimed];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+set_primary(struct connector *connector, struct buffer *buf)
+{
+	uint32_t i, slot = ARRAY_SIZE(primaries);
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < ARRAY_SIZE(primaries); i++) {
+		if (primaries[i].crtc == connector->crtc) {
+			slot = i;
+			break;
+		}
+		if (!primaries[i].crtc && (slot == ARRAY_SIZE(primaries)))
+			slot = i;
+	}
+	if (slot < ARRAY_SIZE(primaries)) {
+		primaries[slot].crtc = connector->crtc;
+		primaries[slot].buf = buf;
+		primaries[slot].x = connector->x;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* call with the lock held: */
+static bool
+shows_crtc(struct display_kms *disp_kms, int crtc)
+{
+	uint32_t i;
+
+	for (i = 0; i < disp_kms->connectors_count; i++)
+		if (disp_kms->connector[i].crtc == crtc)
+			return true;
+
+	return false;
+}
+
+/* the rect of the crtc which shows the stream: */
+static void
+stream_rect(struct display *disp, struct connector *connector,
+		uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	drmModeModeInfo *mode = connector->mode;
+	struct display_kms *other;
+	uint32_t n = 0, k = 0, cols, rows;
+
+	if (disp_kms->window) {
+		*x = MIN(disp_kms->win_x, mode->hdisplay - 1u);
+		*y = MIN(disp_kms->win_y, mode->vdisplay - 1u);
+		*w = MIN(disp_kms->win_w, mode->hdisplay - *x);
+		*h = MIN(disp_kms->win_h, mode->vdisplay - *y);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	list_for_each_entry(other, &displays, link) {
+		if (other == disp_kms)
+			k = n;
+		if (other->stream && shows_crtc(other, connector->crtc))
+			n++;
+	}
+	cols = grid_cols;
+	rows = grid_rows;
+	pthread_mutex_unlock(&lock);
+
+	if (!cols) {
+		/* as square as possible, a single stream is fullscreen: */
+		for (cols = 1; cols * cols < n; cols++)
+			continue;
+		rows = MAX(1u, (n + cols - 1) / cols);
+	}
+
+	k %= cols * rows;
+
+	*w = mode->hdisplay / cols;
+	*h = mode->vdisplay / rows;
+	*x = (k % cols) * *w;
+	*y = (k / cols) * *h;
+}
+
 static struct omap_bo *
-alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
-		uint32_t *bo_handle, uint32_t *pitch)
+alloc_bo(struct display *disp, enum mem_purpose purpose, uint32_t bpp,
+		uint32_t width, uint32_t height, uint32_t *bo_handle, uint32_t *pitch)
 {
 	struct display_kms *disp_kms = to_display_kms(disp);
 	struct omap_bo *bo;
@@ -91,6 +393,7 @@ alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
 	}
 
 	if (bo) {
+		mem_track_bo(bo, purpose, bo_flags);
 		*bo_handle = omap_bo_handle(bo);
 		*pitch = width * bpp / 8;
 		if (bo_flags & OMAP_BO_TILED)
@@ -100,13 +403,263 @@ alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
 	return bo;
 }
 
+/* Dumb buffers work with any kms driver, but are linear, and one per
+ * buffer, with the planes at offsets in it like with --single-bo.  They are
+ * mapped once, as buf->map, and not in the bo accounting:
+ */
+static int
+alloc_dumb(struct display *disp, struct buffer *buf, uint32_t fourcc,
+		uint32_t *bo_handles)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	struct drm_mode_create_dumb create = {
+			.width = buf->width,
+			.height = buf->height,
+	};
+	struct drm_mode_map_dumb map = {0};
+	int i, fd;
+
+	switch (fourcc) {
+	case FOURCC('A','R','2','4'):
+		create.bpp = 32;
+		break;
+	case FOURCC('U','Y','V','Y'):
+	case FOURCC('Y','U','Y','V'):
+		create.bpp = 16;
+		break;
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'):
+		create.bpp = 8;
+		create.height = buf->height * 3 / 2;
+		break;
+	default:
+		ERROR("invalid format: 0x%08x", fourcc);
+		return -1;
+	}
+
+	if (drmIoctl(disp->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+		ERROR("could not create dumb buffer: %s", strerror(errno));
+		return -1;
+	}
+	buf_kms->handle = create.handle;
+	buf_kms->size = create.size;
+	buf->size = create.size;
+
+	buf->nbo = 0;
+	buf->multiplanar = false;
+	buf->pitches[0] = create.pitch;
+	if (fourcc == FOURCC('N','V','1','2')) {
+		buf->pitches[1] = buf->pitches[0];
+		buf->offsets[1] = buf->pitches[0] * buf->height;
+	} else if (fourcc == FOURCC('I','4','2','0')) {
+		buf->pitches[1] = buf->pitches[2] = buf->pitches[0] / 2;
+		buf->offsets[1] = buf->pitches[0] * buf->height;
+		buf->offsets[2] = buf->offsets[1] +
+				buf->pitches[1] * (buf->height / 2);
+	}
+	for (i = 0; i < fourcc_planes(fourcc); i++)
+		bo_handles[i] = create.handle;
+
+	map.handle = create.handle;
+	if (drmIoctl(disp->fd, DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+		ERROR("could not map dumb buffer: %s", strerror(errno));
+		return -1;
+	}
+
+	buf->map = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			disp->fd, map.offset);
+	if (buf->map == MAP_FAILED) {
+		buf->map = NULL;
+		ERROR("mmap failed: %s", strerror(errno));
+		return -1;
+	}
+
+	/* to wait for the display to be done with it before it is written
+	 * again, and for other devices to import it.  Not all drivers can
+	 * export dumb buffers, which is fine:
+	 */
+	if (!drmPrimeHandleToFD(disp->fd, create.handle, DRM_CLOEXEC | DRM_RDWR, &fd))
+		buf->dmabuf[buf->ndmabuf++] = fd;
+
+	return 0;
+}
+
+static void
+free_buffer(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	uint32_t j;
+	int i;
+
+	list_del(&buf_kms->link);
+
+	/* removing the fb takes it off the screen: */
+	for (j = 0; j < disp_kms->connectors_count; j++) {
+		struct connector *connector = &disp_kms->connector[j];
+		if (connector->shown == buf)
+			connector->shown = NULL;
+		if (connector->flipping == buf)
+			connector->flipping = NULL;
+		if (connector->queued == buf)
+			connector->queued = NULL;
+		if (connector->vid == buf)
+			connector->vid = NULL;
+	}
+	if (disp_kms->current == buf)
+		disp_kms->current = NULL;
+	if (disp_kms->vid == buf)
+		disp_kms->vid = NULL;
+	if (disp_kms->vid_retired == buf)
+		disp_kms->vid_retired = NULL;
+
+	pthread_mutex_lock(&lock);
+	for (j = 0; j < ARRAY_SIZE(primaries); j++)
+		if (primaries[j].buf == buf)
+			primaries[j].buf = NULL;
+	pthread_mutex_unlock(&lock);
+
+	while (buf_kms->nrelease)
+		close(buf_kms->release_fence[--buf_kms->nrelease]);
+	if (buf->acquire_fence >= 0)
+		close(buf->acquire_fence);
+
+	if (buf_kms->fb_id)
+		drmModeRmFB(disp->fd, buf_kms->fb_id);
+
+	/* note: the dmabuf fds belong to the bo's (omap_bo_dmabuf() returns
+	 * the same fd every time, v4l2 relies on that too), and are closed
+	 * with them:
+	 */
+	for (i = 0; i < buf->nbo; i++) {
+		if (buf->bo[i]) {
+			mem_untrack_bo(buf->bo[i]);
+			omap_bo_del(buf->bo[i]);
+		}
+	}
+
+	/* a dumb buffer's dmabuf is ours to close: */
+	if (buf_kms->handle) {
+		struct drm_mode_destroy_dumb destroy = {
+				.handle = buf_kms->handle,
+		};
+
+		while (buf->ndmabuf)
+			close(buf->dmabuf[--buf->ndmabuf]);
+		if (buf->map)
+			munmap(buf->map, buf->size);
+		drmIoctl(disp->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+
+	free(buf_kms);
+}
+
+/*
+ * Buffer cache:
+ *
+ * Freed buffers are kept, with their bo's and fb, to be handed out again
+ * for an allocation with the same purpose, format, size and bo flags.  When
+ * the cache grows past its size limit, the least recently freed buffers are
+ * really freed.  A buffer which is freed while it is still on screen (or
+ * being flipped to) waits on the deferred list until it is off screen, so
+ * that it is neither handed out nor evicted while the display reads it.
+ */
+
+static bool
+on_screen(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	return (buf_kms->scanout_refs > 0) || (disp_kms->vid == buf) ||
+			(disp_kms->vid_retired == buf);
+}
+
+static struct buffer *
+cache_get(struct display *disp, enum mem_purpose purpose,
+		uint32_t fourcc, uint32_t w, uint32_t h)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms;
+
+	list_for_each_entry(buf_kms, &disp_kms->cache, cache) {
+		struct buffer *buf = &buf_kms->base;
+		if ((buf->fourcc == fourcc) && (buf->width == w) &&
+				(buf->height == h) && (buf_kms->purpose == purpose) &&
+				(buf_kms->bo_flags == disp_kms->bo_flags)) {
+			list_del(&buf_kms->cache);
+			disp_kms->cache_bytes -= buf_kms->size;
+			disp_kms->cache_hits++;
+			buf->fenced = false;
+			buf_kms->internal = false;
+			return buf;
+		}
+	}
+
+	disp_kms->cache_misses++;
+	return NULL;
+}
+
+static void
+cache_put(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	if (on_screen(disp, buf)) {
+		if (!buf_kms->deferred) {
+			DBG("deferring %p until it is off screen", buf);
+			list_add(&buf_kms->cache, &disp_kms->deferred);
+			buf_kms->deferred = true;
+		}
+		return;
+	}
+
+	if (buf_kms->deferred) {
+		list_del(&buf_kms->cache);
+		buf_kms->deferred = false;
+	}
+
+	list_add(&buf_kms->cache, &disp_kms->cache);
+	disp_kms->cache_bytes += buf_kms->size;
+
+	while (disp_kms->cache_bytes > disp_kms->cache_max) {
+		buf_kms = list_last_entry(&disp_kms->cache, struct buffer_kms, cache);
+		list_del(&buf_kms->cache);
+		disp_kms->cache_bytes -= buf_kms->size;
+		disp_kms->cache_evictions++;
+		DBG("evicting %p from buffer cache", &buf_kms->base);
+		free_buffer(disp, &buf_kms->base);
+	}
+}
+
+static void
+cache_print_stats(struct display *disp)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+
+	MSG("buffer cache: %u hits, %u misses, %u evictions, %llu of %llu KiB used",
+			disp_kms->cache_hits, disp_kms->cache_misses,
+			disp_kms->cache_evictions,
+			(unsigned long long)disp_kms->cache_bytes / 1024,
+			(unsigned long long)disp_kms->cache_max / 1024);
+}
+
 static struct buffer *
-alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
+alloc_buffer(struct display *disp, enum mem_purpose purpose,
+		uint32_t fourcc, uint32_t w, uint32_t h)
 {
+	struct display_kms *disp_kms = to_display_kms(disp);
 	struct buffer_kms *buf_kms;
 	struct buffer *buf;
-	uint32_t bo_handles[4] = {0}, offsets[4] = {0};
-	int ret;
+	uint32_t bo_handles[4] = {0};
+	int i, ret;
+
+	buf = cache_get(disp, purpose, fourcc, w, h);
+	if (buf) {
+		DBG("recycled %p from buffer cache", buf);
+		return buf;
+	}
 
 	buf_kms = calloc(1, sizeof(*buf_kms));
 	if (!buf_kms) {
@@ -114,43 +667,75 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		return NULL;
 	}
 	buf = &buf_kms->base;
+	list_add(&buf_kms->link, &disp_kms->buffers);
 
 	buf->fourcc = fourcc;
 	buf->width = w;
 	buf->height = h;
 	buf->multiplanar = true;
+	buf_kms->purpose = purpose;
+	buf_kms->bo_flags = disp_kms->bo_flags;
+	buf->acquire_fence = -1;
 
 	buf->nbo = 1;
 
 	if (!fourcc)
 		fourcc = FOURCC('A','R','2','4');
 
+	if (disp_kms->dumb) {
+		if (alloc_dumb(disp, buf, fourcc, bo_handles))
+			goto fail;
+		goto add_fb;
+	}
+
 	switch(fourcc) {
 	case FOURCC('A','R','2','4'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 32, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, purpose, 32, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	case FOURCC('U','Y','V','Y'):
 	case FOURCC('Y','U','Y','V'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 16, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, purpose, 16, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	case FOURCC('N','V','1','2'):
+		if (disp_kms->single_bo) {
+			buf->nbo = 1;
+			buf->multiplanar = false;
+			buf->bo[0] = alloc_bo(disp, purpose, 8, buf->width, buf->height * 3 / 2,
+					&bo_handles[0], &buf->pitches[0]);
+			bo_handles[1] = bo_handles[0];
+			buf->pitches[1] = buf->pitches[0];
+			buf->offsets[1] = buf->pitches[0] * buf->height;
+			break;
+		}
 		buf->nbo = 2;
-		buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, purpose, 8, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
-		buf->bo[1] = alloc_bo(disp, 16, buf->width/2, buf->height/2,
+		buf->bo[1] = alloc_bo(disp, purpose, 16, buf->width/2, buf->height/2,
 				&bo_handles[1], &buf->pitches[1]);
 		break;
 	case FOURCC('I','4','2','0'):
+		if (disp_kms->single_bo) {
+			buf->nbo = 1;
+			buf->multiplanar = false;
+			buf->bo[0] = alloc_bo(disp, purpose, 8, buf->width, buf->height * 3 / 2,
+					&bo_handles[0], &buf->pitches[0]);
+			bo_handles[1] = bo_handles[2] = bo_handles[0];
+			buf->pitches[1] = buf->pitches[2] = buf->pitches[0] / 2;
+			buf->offsets[1] = buf->pitches[0] * buf->height;
+			buf->offsets[2] = buf->offsets[1] +
+					buf->pitches[1] * (buf->height / 2);
+			break;
+		}
 		buf->nbo = 3;
-		buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, purpose, 8, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
-		buf->bo[1] = alloc_bo(disp, 8, buf->width/2, buf->height/2,
+		buf->bo[1] = alloc_bo(disp, purpose, 8, buf->width/2, buf->height/2,
 				&bo_handles[1], &buf->pitches[1]);
-		buf->bo[2] = alloc_bo(disp, 8, buf->width/2, buf->height/2,
+		buf->bo[2] = alloc_bo(disp, purpose, 8, buf->width/2, buf->height/2,
 				&bo_handles[2], &buf->pitches[2]);
 		break;
 	default:
@@ -158,8 +743,17 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		goto fail;
 	}
 
+	for (i = 0; i < buf->nbo; i++) {
+		if (!buf->bo[i]) {
+			ERROR("allocation failed");
+			goto fail;
+		}
+		buf_kms->size += omap_bo_size(buf->bo[i]);
+	}
+
+add_fb:
 	ret = drmModeAddFB2(disp->fd, buf->width, buf->height, fourcc,
-			bo_handles, buf->pitches, offsets, &buf_kms->fb_id, 0);
+			bo_handles, buf->pitches, buf->offsets, &buf_kms->fb_id, 0);
 	if (ret) {
 		ERROR("drmModeAddFB2 failed: %s (%d)", strerror(errno), ret);
 		goto fail;
@@ -168,16 +762,32 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 	return buf;
 
 fail:
-	// XXX cleanup
+	free_buffer(disp, buf);
 	return NULL;
 }
 
+static void
+free_buffers(struct display *disp, struct buffer **bufs, uint32_t n)
+{
+	uint32_t i;
+
+	if (!bufs)
+		return;
+
+	for (i = 0; i < n; i++)
+		if (bufs[i])
+			cache_put(disp, bufs[i]);
+
+	free(bufs);
+}
+
 static struct buffer **
-alloc_buffers(struct display *disp, uint32_t n,
+alloc_buffers(struct display *disp, enum mem_purpose purpose, uint32_t n,
 		uint32_t fourcc, uint32_t w, uint32_t h)
 {
 	struct buffer **bufs;
 	uint32_t i = 0;
+	uint64_t t = time_ns();
 
 	bufs = calloc(n, sizeof(*bufs));
 	if (!bufs) {
@@ -186,54 +796,1067 @@ alloc_buffers(struct display *disp, uint32_t n,
 	}
 
 	for (i = 0; i < n; i++) {
-		bufs[i] = alloc_buffer(disp, fourcc, w, h);
+		bufs[i] = alloc_buffer(disp, purpose, fourcc, w, h);
 		if (!bufs[i]) {
 			ERROR("allocation failed");
 			goto fail;
 		}
 	}
 
+	DBG("allocated %u buffers of %ux%u in %llu us", n, w, h,
+			(unsigned long long)mark_ns(&t) / 1000);
+
 	return bufs;
 
 fail:
-	// XXX cleanup
+	free_buffers(disp, bufs, n);
 	return NULL;
 }
 
-static struct buffer **
-get_buffers(struct display *disp, uint32_t n)
-{
-	return alloc_buffers(disp, n, 0, disp->width, disp->height);
-}
+static struct buffer **
+get_buffers(struct display *disp, uint32_t n)
+{
+	return alloc_buffers(disp, MEM_SCANOUT, n, 0, disp->width, disp->height);
+}
+
+static struct buffer **
+get_vid_buffers(struct display *disp, uint32_t n,
+		uint32_t fourcc, uint32_t w, uint32_t h)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+
+	/* it takes part in the mosaic from now on: */
+	pthread_mutex_lock(&lock);
+	disp_kms->stream = true;
+	pthread_mutex_unlock(&lock);
+
+	return alloc_buffers(disp, MEM_VIDEO, n, fourcc, w, h);
+}
+
+/*
+ * Explicit fences:
+ *
+ * The app can give a buffer an acquire fence, which is passed to the kernel
+ * as IN_FENCE_FD with --atomic, and waited for here otherwise.  With
+ * --atomic, a buffer taken off screen gets the out fences of the commit
+ * which did so, which disp_wait_vid_buffer() waits on before reusing it.
+ */
+
+static void
+wait_fence(int fd)
+{
+	struct pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN,
+	};
+
+	while (poll(&pfd, 1, -1) < 0) {
+		if ((errno != EINTR) && (errno != EAGAIN)) {
+			ERROR("poll failed: %s", strerror(errno));
+			break;
+		}
+	}
+}
+
+static void
+wait_acquire_fence(struct buffer *buf)
+{
+	if (buf->acquire_fence < 0)
+		return;
+
+	TRACE_BEGIN("acquire fence", buf);
+	wait_fence(buf->acquire_fence);
+	close(buf->acquire_fence);
+	buf->acquire_fence = -1;
+	TRACE_END("acquire fence", buf);
+}
+
+static bool
+wait_release(struct display *disp, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	if (!buf_kms->nrelease)
+		return false;
+
+	while (buf_kms->nrelease) {
+		int fd = buf_kms->release_fence[--buf_kms->nrelease];
+		wait_fence(fd);
+		close(fd);
+	}
+
+	return true;
+}
+
+/*
+ * Page flips:
+ *
+ * Each crtc has at most one flip in flight, and one buffer queued to be
+ * flipped to when that completes.  A buffer is referenced by every crtc
+ * which shows it, is flipping to it or has it queued, and is released
+ * once none does.
+ */
+
+/* give up waiting for a flip after: */
+#define FLIP_TIMEOUT_MS 3000
+
+/* hand a video buffer which is off screen, or was only copied from, back
+ * to the app.  The buffers frames are rotated into are not the app's, and
+ * one the app already freed goes to the buffer cache instead:
+ */
+static void
+release_vid(struct display *disp, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms;
+
+	if (!buf)
+		return;
+
+	buf_kms = to_buffer_kms(buf);
+	if (buf_kms->deferred)
+		cache_put(disp, buf);
+	else if (!buf_kms->internal)
+		disp_release_buffer(disp, buf);
+}
+
+static void
+scanout_unref(struct display *disp, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms;
+
+	if (!buf)
+		return;
+
+	buf_kms = to_buffer_kms(buf);
+	if (!--buf_kms->scanout_refs)
+		release_vid(disp, buf);
+}
+
+/* takes over the reference to buf, scheduled for vblank target: */
+static int
+queue_flip(struct display *disp, struct connector *connector,
+		struct buffer *buf, uint32_t target)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	int ret;
+
+	ret = drmModePageFlip(disp->fd, connector->crtc, buf_kms->fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, connector);
+	if (ret) {
+		ERROR("Could not post buffer on crtc %d: %s (%d)",
+				connector->crtc, strerror(errno), ret);
+		scanout_unref(disp, buf);
+		return ret;
+	}
+
+	TRACE_ASYNC_BEGIN("flip", buf);
+	connector->flipping = buf;
+	connector->pending = true;
+	connector->flip_t = time_ns();
+	connector->flip_target = target;
+	disp_kms->scheduled_flips++;
+
+	return 0;
+}
+
+/* does a crtc have no room for another buffer, or with idle, a flip
+ * pending at all:
+ */
+static bool
+flips_busy(struct display *disp, bool idle)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t i;
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+		if (idle ? connector->pending : !!connector->queued)
+			return true;
+	}
+
+	return false;
+}
+
+static void
+flip_done(struct connector *connector, unsigned int frame,
+		unsigned int sec, unsigned int usec)
+{
+	struct display *disp = connector->disp;
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer *old = NULL;
+
+	disp_kms->completed_flips++;
+	disp->flip_seq = frame;
+	disp->flip_ns = ((uint64_t)sec * NSEC_PER_SEC) + (usec * 1000ULL);
+	hist_record(disp_kms->flip_hist, time_ns() - connector->flip_t);
+	disp_check_flip(disp, connector->flip_target, frame);
+
+	MSG("Page flip: frame=%d, sec=%d, usec=%d, remaining=%d", frame, sec, usec,
+			disp_kms->scheduled_flips - disp_kms->completed_flips);
+
+	connector->pending = false;
+
+	/* an atomic commit of only the overlay does not flip the primary: */
+	if (connector->flipping) {
+		TRACE_ASYNC_END("flip", connector->flipping);
+		old = connector->shown;
+		connector->shown = connector->flipping;
+		connector->flipping = NULL;
+		set_primary(connector, connector->shown);
+	}
+
+	if (connector->queued) {
+		struct buffer *buf = connector->queued;
+		connector->queued = NULL;
+		queue_flip(disp, connector, buf, connector->queued_target);
+	}
+
+	/* the video buffer a commit replaced is off screen once it
+	 * completed on every crtc:
+	 */
+	if (disp_kms->vid_retired && !flips_busy(disp, true)) {
+		struct buffer *buf = disp_kms->vid_retired;
+		disp_kms->vid_retired = NULL;
+		release_vid(disp, buf);
+	}
+
+	scanout_unref(disp, old);
+}
+
+static void
+page_flip_handler(int fd, unsigned int frame,
+		unsigned int sec, unsigned int usec, void *data)
+{
+	flip_done(data, frame, sec, usec);
+}
+
+#ifdef HAVE_DRM_ATOMIC
+/* an atomic commit sends an event per crtc, all with the same data: */
+static void
+atomic_flip_handler(int fd, unsigned int frame, unsigned int sec,
+		unsigned int usec, unsigned int crtc_id, void *data)
+{
+	struct display_kms *disp_kms = to_display_kms((struct display *)data);
+	uint32_t i;
+
+	for (i = 0; i < disp_kms->connectors_count; i++)
+		if (disp_kms->connector[i].crtc == (int)crtc_id)
+			flip_done(&disp_kms->connector[i], frame, sec, usec);
+}
+#endif
+
+static int
+dispatch(struct display *disp, int timeout_ms)
+{
+	drmEventContext evctx = {
+			.version = DRM_EVENT_CONTEXT_VERSION,
+			.page_flip_handler = page_flip_handler,
+	};
+	struct pollfd pfd = {
+			.fd = disp->fd,
+			.events = POLLIN,
+	};
+	int ret;
+
+#ifdef HAVE_DRM_ATOMIC
+	struct display_kms *disp_kms = to_display_kms(disp);
+
+	if (disp_kms->atomic)
+		evctx.page_flip_handler2 = atomic_flip_handler;
+#endif
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN))
+			return 0;
+		ERROR("poll failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (ret == 0)
+		return 0;
+
+	drmHandleEvent(disp->fd, &evctx);
+
+	return 1;
+}
+
+/* wait until flips_busy() is false, or with disp_set_nonblock(), fail with
+ * -EAGAIN if it is not already:
+ */
+static int
+wait_flips(struct display *disp, bool idle)
+{
+	int ret;
+
+	for (;;) {
+		if (!flips_busy(disp, idle))
+			return 0;
+
+		if (disp->nonblock)
+			return -EAGAIN;
+
+		ret = dispatch(disp, FLIP_TIMEOUT_MS);
+		if (ret <= 0) {
+			ERROR("Timeout waiting for flip complete");
+			return -1;
+		}
+	}
+}
+
+static int
+post_buffer(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	int ret, last_err = 0;
+	uint32_t i;
+
+	wait_acquire_fence(buf);
+
+	/* handle the flips which already completed, and make room: */
+	dispatch(disp, 0);
+	TRACE_BEGIN("flip wait", buf);
+	last_err = wait_flips(disp, false);
+	TRACE_END("flip wait", buf);
+	if (last_err)
+		return last_err;
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+
+		if (! connector->mode) {
+			continue;
+		}
+
+		buf_kms->scanout_refs++;
+
+		if (! disp_kms->current) {
+			/* first buffer we flip to, setup the mode (since this can't
+			 * be done earlier without a buffer to scanout)
+			 */
+			MSG("Setting mode %s on connector %d, crtc %d",
+					connector->mode_str, connector->id, connector->crtc);
+
+			ret = drmModeSetCrtc(disp->fd, connector->crtc, buf_kms->fb_id,
+					connector->x, 0, &connector->id, 1, connector->mode);
+			if (ret) {
+				ERROR("Could not post buffer on crtc %d: %s (%d)",
+						connector->crtc, strerror(errno), ret);
+				scanout_unref(disp, buf);
+			} else {
+				scanout_unref(disp, connector->shown);
+				connector->shown = buf;
+				set_primary(connector, buf);
+			}
+		} else if (connector->pending) {
+			/* flipped to once the flip in flight completes: */
+			connector->queued = buf;
+			connector->queued_target = disp->rtctl.vbl_target;
+			ret = 0;
+		} else {
+			ret = queue_flip(disp, connector, buf,
+					disp->rtctl.vbl_target);
+		}
+
+		if (ret) {
+			last_err = ret;
+			/* well, keep trying the reset of the connectors.. */
+		}
+	}
+
+	disp_kms->current = buf;
+
+	/* without a release callback, the caller reuses buffers on the
+	 * assumption that only this one is on screen, so wait for the flip:
+	 */
+	if (!disp->release && !disp->nonblock) {
+		TRACE_BEGIN("flip wait", buf);
+		ret = wait_flips(disp, true);
+		TRACE_END("flip wait", buf);
+		if (ret)
+			last_err = ret;
+	}
+
+	return last_err;
+}
+
+/* vblanks are counted on the crtc of the first connector: */
+static int
+wait_vblank(struct display *disp, uint32_t seq, bool relative,
+		uint32_t *cur, uint64_t *ns)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	drmVBlank vbl = {
+			.request = {
+				.type = relative ? DRM_VBLANK_RELATIVE : DRM_VBLANK_ABSOLUTE,
+				.sequence = seq,
+			},
+	};
+	int ret;
+
+	if (disp_kms->vblank_pipe == 1)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	else if (disp_kms->vblank_pipe > 1)
+		vbl.request.type |= (disp_kms->vblank_pipe <<
+				DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+
+	do {
+		ret = drmWaitVBlank(disp->fd, &vbl);
+	} while (ret && (errno == EINTR));
+
+	if (ret) {
+		ERROR("drmWaitVBlank failed: %s", strerror(errno));
+		return ret;
+	}
+
+	*cur = vbl.reply.sequence;
+	*ns = ((uint64_t)vbl.reply.tval_sec * NSEC_PER_SEC) +
+			(vbl.reply.tval_usec * 1000ULL);
+
+	return 0;
+}
+
+/* the id (and value) of an object's property, or 0 if it has none: */
+static uint32_t
+get_prop(struct display *disp, uint32_t obj_id, uint32_t obj_type,
+		const char *name, uint64_t *value)
+{
+	drmModeObjectProperties *props;
+	uint32_t i, id = 0;
+
+	props = drmModeObjectGetProperties(disp->fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (i = 0; !id && (i < props->count_props); i++) {
+		drmModePropertyRes *prop = drmModeGetProperty(disp->fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name)) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return id;
+}
+
+#ifdef HAVE_DRM_ATOMIC
+static uint64_t
+plane_type(struct display *disp, uint32_t plane_id)
+{
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
+	get_prop(disp, plane_id, DRM_MODE_OBJECT_PLANE, "type", &type);
+
+	return type;
+}
+#endif
+
+static bool
+plane_has_format(drmModePlane *ovr, uint32_t fourcc)
+{
+	uint32_t i;
+
+	/* fourcc 0 is RGB, which alloc_buffer() creates as AR24: */
+	if (!fourcc)
+		fourcc = FOURCC('A','R','2','4');
+
+	for (i = 0; i < ovr->count_formats; i++)
+		if (ovr->formats[i] == fourcc)
+			return true;
+
+	return false;
+}
+
+/* find a plane for the pipe, which supports the format (or any format, if
+ * fourcc is ~0).  With unclaimed, one which no stream has claimed, and the
+ * lock must be held:
+ */
+static drmModePlane *
+find_plane(struct display *disp, int pipe, uint32_t fourcc,
+		bool unclaimed, uint32_t *idx)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t j;
+
+	for (j = 0; j < disp_kms->plane_resources->count_planes; j++) {
+		drmModePlane *ovr;
+
+		if (unclaimed && plane_claimed(disp_kms->plane_resources->planes[j]))
+			continue;
+
+		ovr = drmModeGetPlane(disp->fd,
+				disp_kms->plane_resources->planes[j]);
+		if (!ovr)
+			continue;
+
+#ifdef HAVE_DRM_ATOMIC
+		/* with universal planes (which another display on the fd may
+		 * have enabled), the primary and cursor planes are listed too:
+		 */
+		if (plane_type(disp, ovr->plane_id) != DRM_PLANE_TYPE_OVERLAY) {
+			drmModeFreePlane(ovr);
+			continue;
+		}
+#endif
+
+		if ((ovr->possible_crtcs & (1 << pipe)) &&
+				((fourcc == ~0u) || plane_has_format(ovr, fourcc))) {
+			*idx = j;
+			return ovr;
+		}
+
+		drmModeFreePlane(ovr);
+	}
+
+	return NULL;
+}
+
+static bool
+supports_format(struct display *disp, uint32_t fourcc)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t i, j;
+
+	/* every active connector needs a plane for the format: */
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+		drmModePlane *ovr;
+
+		if (! connector->mode) {
+			continue;
+		}
+
+		ovr = find_plane(disp, connector->pipe, fourcc, false, &j);
+		if (!ovr) {
+			DBG("no plane for %.4s on crtc %d",
+					fourcc ? (char *)&fourcc : "RGB4", connector->crtc);
+			return false;
+		}
+
+		drmModeFreePlane(ovr);
+	}
+
+	return true;
+}
+
+/* the overlay of connector i, which is picked (and claimed, so that no
+ * other stream picks it) on first use.  NULL once there is none left:
+ */
+static drmModePlane *
+get_overlay(struct display *disp, uint32_t i, uint32_t fourcc)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct connector *connector = &disp_kms->connector[i];
+	uint32_t j;
+
+	if (disp_kms->ovr[i] || disp_kms->composite[i])
+		return disp_kms->ovr[i];
+
+	pthread_mutex_lock(&lock);
+
+	/* prefer a plane which can scan out the buffer's format: */
+	disp_kms->ovr[i] = find_plane(disp, connector->pipe, fourcc, true, &j);
+	if (! disp_kms->ovr[i])
+		disp_kms->ovr[i] = find_plane(disp, connector->pipe, ~0, true, &j);
+
+	if (disp_kms->ovr[i] && (nclaimed < MAX_PLANES)) {
+		claimed[nclaimed++] = disp_kms->ovr[i]->plane_id;
+	} else if (disp_kms->ovr[i]) {
+		drmModeFreePlane(disp_kms->ovr[i]);
+		disp_kms->ovr[i] = NULL;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	if (! disp_kms->ovr[i]) {
+		MSG("Could not find plane for crtc %d, compositing", connector->crtc);
+		disp_kms->composite[i] = true;
+	}
+
+	return disp_kms->ovr[i];
+}
+
+/*
+ * Rotation:
+ *
+ * With --rotate, the overlays scan out a rotated view of the frame, which
+ * costs no memory bandwidth.  On omapdrm that is a rotated view of the
+ * TILER container, so the buffers are tiled, other drivers rotate as they
+ * can.  When a plane can't, the frames are rotated by the cpu instead.
+ */
+
+/* the rotation property of a plane, if it can do the rotation.  The values
+ * of the bitmask are bit numbers:
+ */
+static uint32_t
+rotation_prop(struct display *disp, uint32_t plane_id, uint32_t degrees)
+{
+	drmModePropertyRes *prop;
+	uint32_t id;
+	int i;
+
+	id = get_prop(disp, plane_id, DRM_MODE_OBJECT_PLANE, "rotation", NULL);
+	if (!id)
+		return 0;
+
+	prop = drmModeGetProperty(disp->fd, id);
+	if (!prop)
+		return 0;
+
+	for (i = 0; i < prop->count_enums; i++)
+		if (prop->enums[i].value == degrees / 90)
+			break;
+	if (i == prop->count_enums)
+		id = 0;
+
+	drmModeFreeProperty(prop);
+
+	return id;
+}
+
+/* on the first video frame, once the overlays are picked, set them all to
+ * rotate, or else rotate on the cpu:
+ */
+static void
+setup_rotation(struct display *disp, uint32_t fourcc)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	bool cpu = false;
+	uint32_t i;
+
+	disp_kms->rotation_checked = true;
+	if (!disp_kms->rotation)
+		return;
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		drmModePlane *ovr;
+
+		if (! disp_kms->connector[i].mode) {
+			continue;
+		}
+
+		ovr = get_overlay(disp, i, fourcc);
+		if (ovr)
+			disp_kms->rot_prop[i] = rotation_prop(disp, ovr->plane_id,
+					disp_kms->rotation);
+		if (!disp_kms->rot_prop[i])
+			cpu = true;
+	}
+
+	for (i = 0; !cpu && (i < disp_kms->connectors_count); i++) {
+		if (!disp_kms->rot_prop[i])
+			continue;
+		if (drmModeObjectSetProperty(disp->fd, disp_kms->ovr[i]->plane_id,
+				DRM_MODE_OBJECT_PLANE, disp_kms->rot_prop[i],
+				1 << (disp_kms->rotation / 90))) {
+			ERROR("could not rotate plane %d: %s",
+					disp_kms->ovr[i]->plane_id, strerror(errno));
+			cpu = true;
+		}
+	}
+
+	if (cpu) {
+		/* the planes which were set can't rotate on top of it: */
+		for (i = 0; i < disp_kms->connectors_count; i++) {
+			if (disp_kms->rot_prop[i])
+				drmModeObjectSetProperty(disp->fd,
+						disp_kms->ovr[i]->plane_id,
+						DRM_MODE_OBJECT_PLANE,
+						disp_kms->rot_prop[i], 1);
+			disp_kms->rot_prop[i] = 0;
+		}
+		MSG("planes can't rotate by %u, rotating on the cpu",
+				disp_kms->rotation);
+	}
+
+	disp_kms->cpu_rotate = cpu;
+}
+
+/* rotate the x,y,w,h rect of buf into the next of the rot_bufs, which
+ * is posted instead:
+ */
+static struct buffer *
+rotate_frame(struct display *disp, struct buffer *buf,
+		uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer *rot;
+	uint32_t i, rw, rh;
+	uint64_t t;
+	int ret;
+
+	/* subsampled chroma needs an even rect: */
+	if (fourcc_planes(buf->fourcc) > 1) {
+		*x &= ~1;
+		*y &= ~1;
+		*w &= ~1;
+		*h &= ~1;
+	}
+
+	rw = (disp_kms->rotation % 180) ? *h : *w;
+	rh = (disp_kms->rotation % 180) ? *w : *h;
+
+	if (disp_kms->rot_bufs && ((disp_kms->rot_bufs[0]->fourcc != buf->fourcc) ||
+			(disp_kms->rot_bufs[0]->width != rw) ||
+			(disp_kms->rot_bufs[0]->height != rh))) {
+		free_buffers(disp, disp_kms->rot_bufs, NROT);
+		disp_kms->rot_bufs = NULL;
+	}
+
+	if (!disp_kms->rot_bufs) {
+		disp_kms->rot_bufs = alloc_buffers(disp, MEM_VIDEO, NROT,
+				buf->fourcc, rw, rh);
+		if (!disp_kms->rot_bufs)
+			return NULL;
+		for (i = 0; i < NROT; i++) {
+			struct buffer_kms *rot_kms = to_buffer_kms(disp_kms->rot_bufs[i]);
+			rot_kms->internal = true;
+		}
+	}
+
+	rot = disp_kms->rot_bufs[disp_kms->rot_idx++ % NROT];
+
+	/* with --atomic, the display may still be reading it: */
+	wait_release(disp, rot);
+	wait_acquire_fence(buf);
+
+	TRACE_BEGIN("cpu rotate", buf);
+	t = time_ns();
+	ret = convert_rotate(buf, *x, *y, *w, *h, rot, disp_kms->rotation);
+	hist_record(disp_kms->rotate_hist, time_ns() - t);
+	TRACE_END("cpu rotate", buf);
+
+	if (ret) {
+		ERROR("could not rotate %.4s", (char *)&buf->fourcc);
+		return NULL;
+	}
+
+	*x = 0;
+	*y = 0;
+	*w = rw;
+	*h = rh;
+
+	return rot;
+}
+
+/* scale the video into the buffer the primary plane of the crtc shows,
+ * which is on screen right away:
+ */
+static int
+composite(struct display *disp, struct connector *connector,
+		struct buffer *buf, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	uint32_t i, dx, dy, dw, dh;
+	int ret = -1;
+
+	stream_rect(disp, connector, &dx, &dy, &dw, &dh);
+	wait_acquire_fence(buf);
+
+	TRACE_BEGIN("composite", buf);
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < ARRAY_SIZE(primaries); i++) {
+		if ((primaries[i].crtc == connector->crtc) && primaries[i].buf) {
+			ret = convert_blit(buf, x, y, w, h, primaries[i].buf,
+					primaries[i].x + dx, dy, dw, dh);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	TRACE_END("composite", buf);
+
+	if (ret)
+		ERROR("could not composite %.4s on crtc %d", (char *)&buf->fourcc,
+				connector->crtc);
+
+	return ret;
+}
+
+static int
+post_vid_buffer(struct display *disp, struct buffer *buf,
+		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms;
+	struct buffer *rot;
+	int ret, last_err = 0;
+	uint32_t i, dx, dy, dw, dh;
+
+	wait_acquire_fence(buf);
+
+	if (!disp_kms->rotation_checked)
+		setup_rotation(disp, buf->fourcc);
+	if (disp_kms->cpu_rotate) {
+		rot = rotate_frame(disp, buf, &x, &y, &w, &h);
+		if (!rot)
+			return -1;
+		release_vid(disp, buf);
+		buf = rot;
+	}
+	buf_kms = to_buffer_kms(buf);
+
+	/* held until every connector had it, so that it is released right
+	 * away (below) if none shows it:
+	 */
+	buf_kms->scanout_refs++;
+
+	/* ensure we have the overlay setup: */
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+
+		if (! connector->mode) {
+			continue;
+		}
+
+		if (! get_overlay(disp, i, buf->fourcc)) {
+			if (composite(disp, connector, buf, x, y, w, h))
+				last_err = -1;
+			/* carry on with the rest of the connectors */
+			continue;
+		}
+
+		stream_rect(disp, connector, &dx, &dy, &dw, &dh);
+
+		TRACE_BEGIN("set plane", buf);
+		ret = drmModeSetPlane(disp->fd, disp_kms->ovr[i]->plane_id,
+				connector->crtc, buf_kms->fb_id, 0,
+				dx, dy, dw, dh,
+				/* source/cropping coordinates are given in Q16 */
+				x << 16, y << 16, w << 16, h << 16);
+		TRACE_END("set plane", buf);
+		if (ret) {
+			ERROR("failed to enable plane %d: %s",
+					disp_kms->ovr[i]->plane_id, strerror(errno));
+			/* the plane still shows the previous buffer */
+			last_err = ret;
+			continue;
+		}
+
+		/* a legacy plane update has landed when it returns, so the
+		 * previous buffer is off this crtc:
+		 */
+		buf_kms->scanout_refs++;
+		scanout_unref(disp, connector->vid);
+		connector->vid = buf;
+	}
+
+	/* one which is only composited (or failed everywhere) was never on
+	 * screen:
+	 */
+	scanout_unref(disp, buf);
+
+	return last_err;
+}
+
+#ifdef HAVE_DRM_ATOMIC
+/*
+ * Atomic modesetting:
+ *
+ * The primary plane and overlay of every crtc are updated in one
+ * nonblocking commit, so that they land in the same vblank.  One commit
+ * is in flight at a time, a post waits for the previous one to complete.
+ */
+
+/* show the x,y,w,h rect of buf in the dx,dy,dw,dh rect of the crtc: */
+static void
+add_plane(drmModeAtomicReq *req, struct display *disp, uint32_t plane_id,
+		struct connector *connector, struct buffer *buf,
+		uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+		uint32_t dx, uint32_t dy, uint32_t dw, uint32_t dh)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.fb_id, buf_kms->fb_id);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.crtc_id, connector->crtc);
+	/* source coordinates are given in Q16: */
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.src_x, x << 16);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.src_y, y << 16);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.src_w, w << 16);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.src_h, h << 16);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.crtc_x, dx);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.crtc_y, dy);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.crtc_w, dw);
+	drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.crtc_h, dh);
+
+	if (buf->acquire_fence >= 0)
+		drmModeAtomicAddProperty(req, plane_id, disp_kms->prop.in_fence_fd,
+				buf->acquire_fence);
+}
+
+/* commit the current primary and video buffers: */
+static int
+atomic_commit(struct display *disp)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	drmModeAtomicReq *req;
+	uint32_t i, dx, dy, dw, dh;
+	int ret;
+
+	/* without IN_FENCE_FD, wait for the buffers here: */
+	if (!disp_kms->prop.in_fence_fd) {
+		if (disp_kms->current)
+			wait_acquire_fence(disp_kms->current);
+		if (disp_kms->vid)
+			wait_acquire_fence(disp_kms->vid);
+	}
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		ERROR("allocation failed");
+		return -1;
+	}
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+		drmModeModeInfo *mode = connector->mode;
+
+		if (! mode) {
+			continue;
+		}
+
+		if (! disp_kms->active) {
+			MSG("Setting mode %s on connector %d, crtc %d",
+					connector->mode_str, connector->id, connector->crtc);
+			drmModeAtomicAddProperty(req, connector->id,
+					disp_kms->prop.conn_crtc_id, connector->crtc);
+			drmModeAtomicAddProperty(req, connector->crtc,
+					disp_kms->prop.crtc_mode_id, connector->mode_blob);
+			drmModeAtomicAddProperty(req, connector->crtc,
+					disp_kms->prop.crtc_active, 1);
+			flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+		}
+
+		if (disp_kms->prop.crtc_out_fence_ptr) {
+			connector->out_fence = -1;
+			drmModeAtomicAddProperty(req, connector->crtc,
+					disp_kms->prop.crtc_out_fence_ptr,
+					(uintptr_t)&connector->out_fence);
+		}
+
+		/* the side-by-side virtual display, only when it changed, so
+		 * that the streams of a mosaic do not flip it back and forth:
+		 */
+		if (disp_kms->current && (disp_kms->primary_dirty || !disp_kms->active))
+			add_plane(req, disp, connector->primary_id, connector,
+					disp_kms->current, connector->x, 0,
+					mode->hdisplay, mode->vdisplay,
+					0, 0, mode->hdisplay, mode->vdisplay);
+
+		if (disp_kms->vid && disp_kms->ovr[i]) {
+			stream_rect(disp, connector, &dx, &dy, &dw, &dh);
+			add_plane(req, disp, disp_kms->ovr[i]->plane_id, connector,
+					disp_kms->vid, disp_kms->vid_x, disp_kms->vid_y,
+					disp_kms->vid_w, disp_kms->vid_h, dx, dy, dw, dh);
+		}
+	}
+
+	TRACE_BEGIN("atomic commit", NULL);
+	for (;;) {
+		ret = drmModeAtomicCommit(disp->fd, req, flags, disp);
+		/* the commit of another stream may be in flight on the crtc: */
+		if (!ret || (errno != EBUSY) || (dispatch(disp, FLIP_TIMEOUT_MS) <= 0))
+			break;
+	}
+	TRACE_END("atomic commit", NULL);
+	drmModeAtomicFree(req);
+
+	if (ret) {
+		ERROR("atomic commit failed: %s", strerror(errno));
+		return ret;
+	}
+
+	/* the kernel holds on to the in fences: */
+	if (disp_kms->current && (disp_kms->current->acquire_fence >= 0)) {
+		close(disp_kms->current->acquire_fence);
+		disp_kms->current->acquire_fence = -1;
+	}
+	if (disp_kms->vid && (disp_kms->vid->acquire_fence >= 0)) {
+		close(disp_kms->vid->acquire_fence);
+		disp_kms->vid->acquire_fence = -1;
+	}
+
+	disp_kms->active = true;
+	disp_kms->primary_dirty = false;
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+
+		if (! connector->mode) {
+			continue;
+		}
+
+		connector->pending = true;
+		connector->flip_t = time_ns();
+		connector->flip_target = disp->rtctl.vbl_target;
+		disp_kms->scheduled_flips++;
+	}
 
-static struct buffer **
-get_vid_buffers(struct display *disp, uint32_t n,
-		uint32_t fourcc, uint32_t w, uint32_t h)
-{
-	return alloc_buffers(disp, n, fourcc, w, h);
+	return 0;
 }
 
+/* the out fences of the last commit signal once old is off screen: */
 static void
-page_flip_handler(int fd, unsigned int frame,
-		unsigned int sec, unsigned int usec, void *data)
+take_out_fences(struct display *disp, struct buffer *old)
 {
-	struct display *disp = data;
 	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *old_kms = old ? to_buffer_kms(old) : NULL;
+	uint32_t i;
 
-	disp_kms->completed_flips++;
+	/* fences from an earlier time it was taken off screen: */
+	while (old_kms && old_kms->nrelease)
+		close(old_kms->release_fence[--old_kms->nrelease]);
 
-	MSG("Page flip: frame=%d, sec=%d, usec=%d, remaining=%d", frame, sec, usec,
-			disp_kms->scheduled_flips - disp_kms->completed_flips);
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+
+		if (connector->out_fence < 0)
+			continue;
+
+		if (old_kms)
+			old_kms->release_fence[old_kms->nrelease++] = connector->out_fence;
+		else
+			close(connector->out_fence);
+
+		connector->out_fence = -1;
+	}
 }
 
 static int
-post_buffer(struct display *disp, struct buffer *buf)
+post_buffer_atomic(struct display *disp, struct buffer *buf)
 {
 	struct display_kms *disp_kms = to_display_kms(disp);
 	struct buffer_kms *buf_kms = to_buffer_kms(buf);
-	int ret, last_err = 0, x = 0;
+	struct buffer *old = disp_kms->current;
+	int ret;
 	uint32_t i;
 
+	/* handle the commit which already completed, or wait for it: */
+	dispatch(disp, 0);
+	TRACE_BEGIN("flip wait", buf);
+	ret = wait_flips(disp, true);
+	TRACE_END("flip wait", buf);
+	if (ret)
+		return ret;
+
+	disp_kms->current = buf;
+	disp_kms->primary_dirty = true;
+	ret = atomic_commit(disp);
+	if (ret) {
+		disp_kms->current = old;
+		return ret;
+	}
+
+	take_out_fences(disp, NULL);
+
 	for (i = 0; i < disp_kms->connectors_count; i++) {
 		struct connector *connector = &disp_kms->connector[i];
 
@@ -241,124 +1864,286 @@ post_buffer(struct display *disp, struct buffer *buf)
 			continue;
 		}
 
-		if (! disp_kms->current) {
-			/* first buffer we flip to, setup the mode (since this can't
-			 * be done earlier without a buffer to scanout)
-			 */
-			MSG("Setting mode %s on connector %d, crtc %d",
-					connector->mode_str, connector->id, connector->crtc);
+		buf_kms->scanout_refs++;
+		connector->flipping = buf;
+		TRACE_ASYNC_BEGIN("flip", buf);
+	}
 
-			ret = drmModeSetCrtc(disp->fd, connector->crtc, buf_kms->fb_id,
-					x, 0, &connector->id, 1, connector->mode);
+	/* same as post_buffer(): */
+	if (!disp->release && !disp->nonblock) {
+		TRACE_BEGIN("flip wait", buf);
+		ret = wait_flips(disp, true);
+		TRACE_END("flip wait", buf);
+	}
 
-			x += connector->mode->hdisplay;
-		} else {
-			ret = drmModePageFlip(disp->fd, connector->crtc, buf_kms->fb_id,
-					DRM_MODE_PAGE_FLIP_EVENT, disp);
-			disp_kms->scheduled_flips++;
-		}
+	return ret;
+}
 
-		if (ret) {
-			ERROR("Could not post buffer on crtc %d: %s (%d)",
-					connector->crtc, strerror(errno), ret);
-			last_err = ret;
-			/* well, keep trying the reset of the connectors.. */
-		}
-	}
+static int
+post_vid_buffer_atomic(struct display *disp, struct buffer *buf,
+		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer *old = disp_kms->vid;
+	bool overlay = false;
+	int ret = 0;
+	uint32_t i;
 
-	/* if we flipped, wait for all flips to complete! */
-	while (disp_kms->scheduled_flips > disp_kms->completed_flips) {
-		drmEventContext evctx = {
-				.version = DRM_EVENT_CONTEXT_VERSION,
-				.page_flip_handler = page_flip_handler,
-		};
-		struct timeval timeout = {
-				.tv_sec = 3,
-				.tv_usec = 0,
-		};
-		fd_set fds;
+	/* not worth compositing a frame which can't be committed yet: */
+	dispatch(disp, 0);
+	if (disp->nonblock && flips_busy(disp, true))
+		return -EAGAIN;
+
+	if (!disp_kms->rotation_checked)
+		setup_rotation(disp, buf->fourcc);
+	if (disp_kms->cpu_rotate) {
+		struct buffer *rot = rotate_frame(disp, buf, &x, &y, &w, &h);
+		if (!rot)
+			return -1;
+		release_vid(disp, buf);
+		buf = rot;
+	}
 
-		FD_ZERO(&fds);
-		FD_SET(disp->fd, &fds);
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
 
-		ret = select(disp->fd + 1, &fds, NULL, NULL, &timeout);
-		if (ret <= 0) {
-			if (errno == EAGAIN) {
-				continue;    /* keep going */
-			} else {
-				ERROR("Timeout waiting for flip complete: %s (%d)",
-						strerror(errno), ret);
-				last_err = ret;
-				break;
-			}
+		if (! connector->mode) {
+			continue;
 		}
 
-		drmHandleEvent(disp->fd, &evctx);
+		if (get_overlay(disp, i, buf->fourcc))
+			overlay = true;
+		else if (composite(disp, connector, buf, x, y, w, h))
+			ret = -1;
 	}
 
-	disp_kms->current = buf;
+	/* nothing to commit when it is composited everywhere: */
+	if (!ret && !overlay)
+		release_vid(disp, buf);
+	if (ret || !overlay)
+		return ret;
+
+	TRACE_BEGIN("flip wait", buf);
+	ret = wait_flips(disp, true);
+	TRACE_END("flip wait", buf);
+	if (ret)
+		return ret;
+
+	disp_kms->vid = buf;
+	disp_kms->vid_x = x;
+	disp_kms->vid_y = y;
+	disp_kms->vid_w = w;
+	disp_kms->vid_h = h;
+
+	ret = atomic_commit(disp);
+	if (ret) {
+		disp_kms->vid = old;
+		return ret;
+	}
 
-	return last_err;
+	take_out_fences(disp, (old != buf) ? old : NULL);
+
+	/* released once the commit completed, the previous one did: */
+	if (old != buf) {
+		struct buffer *retired = disp_kms->vid_retired;
+		disp_kms->vid_retired = old;
+		release_vid(disp, retired);
+	}
+
+	return 0;
 }
 
+/* switch to atomic modesetting, if the driver supports it: */
 static int
-post_vid_buffer(struct display *disp, struct buffer *buf,
-		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+atomic_init(struct display *disp)
 {
 	struct display_kms *disp_kms = to_display_kms(disp);
-	struct buffer_kms *buf_kms = to_buffer_kms(buf);
-	int ret = 0;
+	struct connector *first = NULL;
 	uint32_t i, j;
 
-	/* ensure we have the overlay setup: */
+	if (drmSetClientCap(disp->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+			drmSetClientCap(disp->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		MSG("atomic modesetting is not supported, using legacy");
+		goto fail;
+	}
+
+	disp_kms->atomic = true;
+
+	/* the primary planes are only listed with universal planes: */
+	drmModeFreePlaneResources(disp_kms->plane_resources);
+	disp_kms->plane_resources = drmModeGetPlaneResources(disp->fd);
+	if (!disp_kms->plane_resources) {
+		ERROR("drmModeGetPlaneResources failed: %s", strerror(errno));
+		return -1;
+	}
+
 	for (i = 0; i < disp_kms->connectors_count; i++) {
 		struct connector *connector = &disp_kms->connector[i];
-		uint32_t used_planes = 0;
-		drmModeModeInfo *mode = connector->mode;
 
-		if (! mode) {
+		if (! connector->mode) {
 			continue;
 		}
 
-		if (! disp_kms->ovr[i]) {
+		for (j = 0; j < disp_kms->plane_resources->count_planes; j++) {
+			uint32_t plane_id = disp_kms->plane_resources->planes[j];
+			drmModePlane *plane = drmModeGetPlane(disp->fd, plane_id);
+			bool found;
+
+			if (!plane)
+				continue;
+			found = (plane->possible_crtcs & (1 << connector->pipe)) &&
+					(plane_type(disp, plane_id) == DRM_PLANE_TYPE_PRIMARY);
+			drmModeFreePlane(plane);
 
-			for (j = 0; j < disp_kms->plane_resources->count_planes; j++) {
-				drmModePlane *ovr = drmModeGetPlane(disp->fd,
-						disp_kms->plane_resources->planes[j]);
-				if ((ovr->possible_crtcs & (1 << connector->pipe)) &&
-						!(used_planes & (1 << j))) {
-					disp_kms->ovr[i] = ovr;
-					used_planes |= (1 << j);
-					break;
-				}
+			if (found) {
+				connector->primary_id = plane_id;
+				break;
 			}
 		}
 
-		if (! disp_kms->ovr[i]) {
-			MSG("Could not find plane for crtc %d", connector->crtc);
-			ret = -1;
-			/* carry on and see if we can find at least one usable plane */
-			continue;
+		if (!connector->primary_id) {
+			MSG("no primary plane for crtc %d, using legacy", connector->crtc);
+			goto fail;
 		}
 
-		ret = drmModeSetPlane(disp->fd, disp_kms->ovr[i]->plane_id,
-				connector->crtc, buf_kms->fb_id, 0,
-				/* make video fullscreen: */
-				0, 0, mode->hdisplay, mode->vdisplay,
-				/* source/cropping coordinates are given in Q16 */
-				x << 16, y << 16, w << 16, h << 16);
-		if (ret) {
-			ERROR("failed to enable plane %d: %s",
-					disp_kms->ovr[i]->plane_id, strerror(errno));
+		if (drmModeCreatePropertyBlob(disp->fd, connector->mode,
+				sizeof(*connector->mode), &connector->mode_blob)) {
+			ERROR("could not create mode blob: %s", strerror(errno));
+			goto fail;
 		}
+
+		if (!first)
+			first = connector;
 	}
 
-	return ret;
+	if (!first)
+		goto fail;
+
+#define PROP(obj, type, name) get_prop(disp, obj, DRM_MODE_OBJECT_##type, name, NULL)
+	disp_kms->prop.conn_crtc_id = PROP(first->id, CONNECTOR, "CRTC_ID");
+	disp_kms->prop.crtc_mode_id = PROP(first->crtc, CRTC, "MODE_ID");
+	disp_kms->prop.crtc_active = PROP(first->crtc, CRTC, "ACTIVE");
+	disp_kms->prop.crtc_out_fence_ptr = PROP(first->crtc, CRTC, "OUT_FENCE_PTR");
+	disp_kms->prop.fb_id = PROP(first->primary_id, PLANE, "FB_ID");
+	disp_kms->prop.crtc_id = PROP(first->primary_id, PLANE, "CRTC_ID");
+	disp_kms->prop.src_x = PROP(first->primary_id, PLANE, "SRC_X");
+	disp_kms->prop.src_y = PROP(first->primary_id, PLANE, "SRC_Y");
+	disp_kms->prop.src_w = PROP(first->primary_id, PLANE, "SRC_W");
+	disp_kms->prop.src_h = PROP(first->primary_id, PLANE, "SRC_H");
+	disp_kms->prop.crtc_x = PROP(first->primary_id, PLANE, "CRTC_X");
+	disp_kms->prop.crtc_y = PROP(first->primary_id, PLANE, "CRTC_Y");
+	disp_kms->prop.crtc_w = PROP(first->primary_id, PLANE, "CRTC_W");
+	disp_kms->prop.crtc_h = PROP(first->primary_id, PLANE, "CRTC_H");
+	disp_kms->prop.in_fence_fd = PROP(first->primary_id, PLANE, "IN_FENCE_FD");
+#undef PROP
+
+	/* the fences are optional (linux 4.10+), the rest is not: */
+	if (!disp_kms->prop.conn_crtc_id || !disp_kms->prop.crtc_mode_id ||
+			!disp_kms->prop.crtc_active || !disp_kms->prop.fb_id ||
+			!disp_kms->prop.crtc_id || !disp_kms->prop.src_x ||
+			!disp_kms->prop.src_y || !disp_kms->prop.src_w ||
+			!disp_kms->prop.src_h || !disp_kms->prop.crtc_x ||
+			!disp_kms->prop.crtc_y || !disp_kms->prop.crtc_w ||
+			!disp_kms->prop.crtc_h) {
+		MSG("missing atomic properties, using legacy");
+		goto fail;
+	}
+
+	MSG("using atomic modesetting, %s fences",
+			disp_kms->prop.crtc_out_fence_ptr ? "with" : "without");
+
+	disp->post_buffer = post_buffer_atomic;
+	disp->post_vid_buffer = post_vid_buffer_atomic;
+
+	return 0;
+
+fail:
+	disp_kms->atomic = false;
+	drmSetClientCap(disp->fd, DRM_CLIENT_CAP_ATOMIC, 0);
+	drmSetClientCap(disp->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+
+	drmModeFreePlaneResources(disp_kms->plane_resources);
+	disp_kms->plane_resources = drmModeGetPlaneResources(disp->fd);
+	if (!disp_kms->plane_resources) {
+		ERROR("drmModeGetPlaneResources failed: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/* free everything, also used to unwind a partially opened display: */
+static void
+free_display(struct display *disp)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms, *tmp;
+	uint32_t i;
+
+	/* the other outputs, which disp_close() closes first when the display
+	 * was opened:
+	 */
+	if (disp->next_output)
+		free_display(disp->next_output);
+
+	/* this frees the cached buffers too.  The fb's are removed before the
+	 * bo's, which takes them off the screen:
+	 */
+	list_for_each_entry_safe(buf_kms, tmp, &disp_kms->buffers, link)
+		free_buffer(disp, &buf_kms->base);
+	free(disp_kms->rot_bufs);
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *c = &disp_kms->connector[i];
+
+#ifdef HAVE_DRM_ATOMIC
+		if (c->mode_blob)
+			drmModeDestroyPropertyBlob(disp->fd, c->mode_blob);
+		if (c->out_fence >= 0)
+			close(c->out_fence);
+#endif
+		if (disp_kms->ovr[i]) {
+			/* for the next display which claims the plane: */
+			if (disp_kms->rot_prop[i])
+				drmModeObjectSetProperty(disp->fd,
+						disp_kms->ovr[i]->plane_id,
+						DRM_MODE_OBJECT_PLANE,
+						disp_kms->rot_prop[i], 1);
+			unclaim_plane(disp_kms->ovr[i]->plane_id);
+			drmModeFreePlane(disp_kms->ovr[i]);
+		}
+		if (c->encoder)
+			drmModeFreeEncoder(c->encoder);
+		if (c->connector)
+			drmModeFreeConnector(c->connector);
+	}
+
+	if (disp_kms->plane_resources)
+		drmModeFreePlaneResources(disp_kms->plane_resources);
+	if (disp_kms->resources)
+		drmModeFreeResources(disp_kms->resources);
+
+	pthread_mutex_lock(&lock);
+	list_del(&disp_kms->link);
+	pthread_mutex_unlock(&lock);
+
+	if (disp->dev)
+		omap_device_del(disp->dev);
+	if (disp->fd >= 0)
+		put_shared_fd();
+
+	free(disp_kms);
 }
 
 static void
 close_kms(struct display *disp)
 {
+	/* so that no flip event arrives for a freed buffer: */
+	disp->nonblock = false;
+	wait_flips(disp, true);
+	cache_print_stats(disp);
+	free_display(disp);
 }
 
 static void
@@ -409,6 +2194,9 @@ connector_find_mode(struct display *disp, struct connector *c)
 		return;
 	}
 
+	/* the mode is in the connector, so keep it until close: */
+	c->connector = connector;
+
 	/* Now get the encoder */
 	for (i = 0; i < disp_kms->resources->count_encoders; i++) {
 		c->encoder = drmModeGetEncoder(disp->fd,
@@ -417,7 +2205,6 @@ connector_find_mode(struct display *disp, struct connector *c)
 		if (!c->encoder) {
 			ERROR("could not get encoder %i: %s",
 					disp_kms->resources->encoders[i], strerror(errno));
-			drmModeFreeEncoder(c->encoder);
 			continue;
 		}
 
@@ -425,6 +2212,13 @@ connector_find_mode(struct display *disp, struct connector *c)
 			break;
 
 		drmModeFreeEncoder(c->encoder);
+		c->encoder = NULL;
+	}
+
+	if (!c->encoder) {
+		ERROR("no encoder for connector %d", c->id);
+		c->mode = NULL;
+		return;
 	}
 
 	if (c->crtc == -1)
@@ -446,32 +2240,52 @@ disp_kms_usage(void)
 	MSG("\t-t <tiled-mode>\t8, 16, 32, or auto");
 	MSG("\t-s <connector_id>:<mode>\tset a mode");
 	MSG("\t-s <connector_id>@<crtc_id>:<mode>\tset a mode");
+	MSG("\t--split\twith several -s, each connector is an output of its own, with");
+	MSG("\t\tbuffers of its size, instead of part of a side-by-side display");
+	MSG("\t--single-bo\tallocate all planes of NV12/I420 buffers in one bo");
+	MSG("\t--dumb\tallocate generic dumb buffers, the default without omapdrm (eg. on vkms)");
+	MSG("\t--rotate <deg>\trotate the video by 0, 90, 180 or 270 degrees (counter-clockwise)");
+	MSG("\t--bo-cache <MiB>\tsize of the cache of freed buffers (default %d)", CACHE_MAX);
+	MSG("\t--window <x>,<y>,<w>x<h>\twhere to show the video on each connector");
+	MSG("\t--grid <cols>x<rows>\tmosaic layout of several streams (default: fit them)");
+#ifdef HAVE_DRM_ATOMIC
+	MSG("\t--atomic\tuse atomic modesetting, if the driver supports it");
+#endif
 }
 
-struct display *
-disp_kms_open(int argc, char **argv)
+/* a display without connectors yet: */
+static struct display_kms *
+alloc_display(void)
 {
-	struct display_kms *disp_kms = NULL;
+	struct display_kms *disp_kms;
 	struct display *disp;
-	int i;
 
 	disp_kms = calloc(1, sizeof(*disp_kms));
 	if (!disp_kms) {
 		ERROR("allocation failed");
-		goto fail;
+		return NULL;
 	}
 	disp = &disp_kms->base;
 
-	disp->fd = drmOpen("omapdrm", NULL);
+	disp_kms->flip_hist = hist_get("kms flip");
+	disp_kms->rotate_hist = hist_get("kms cpu rotate");
+	list_init(&disp_kms->buffers);
+	list_init(&disp_kms->link);
+
+	disp->fd = get_shared_fd();
 	if (disp->fd < 0) {
 		ERROR("could not open drm device: %s (%d)", strerror(errno), errno);
 		goto fail;
 	}
 
-	disp->dev = omap_device_new(disp->fd);
-	if (!disp->dev) {
-		ERROR("couldn't create device");
-		goto fail;
+	if (is_omapdrm(disp->fd)) {
+		disp->dev = omap_device_new(disp->fd);
+		if (!disp->dev) {
+			ERROR("couldn't create device");
+			goto fail;
+		}
+	} else {
+		disp_kms->dumb = true;
 	}
 
 	disp->get_buffers = get_buffers;
@@ -479,6 +2293,14 @@ disp_kms_open(int argc, char **argv)
 	disp->post_buffer = post_buffer;
 	disp->post_vid_buffer = post_vid_buffer;
 	disp->close = close_kms;
+	disp->supports_format = supports_format;
+	disp->free_buffers = free_buffers;
+	disp->dispatch = dispatch;
+	disp->wait_release = wait_release;
+
+	list_init(&disp_kms->cache);
+	list_init(&disp_kms->deferred);
+	disp_kms->cache_max = CACHE_MAX << 20;
 
 	disp_kms->resources = drmModeGetResources(disp->fd);
 	if (!disp_kms->resources) {
@@ -492,6 +2314,111 @@ disp_kms_open(int argc, char **argv)
 		goto fail;
 	}
 
+	return disp_kms;
+
+fail:
+	free_display(disp);
+	return NULL;
+}
+
+/* with --split, move every connector but the first to a display of its
+ * own, with the same options.  They share the drm fd, but not buffers or
+ * flips:
+ */
+static int
+split_outputs(struct display *disp)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct display **next = &disp->next_output;
+	uint32_t i;
+
+	for (i = 1; i < disp_kms->connectors_count; i++) {
+		struct display_kms *out = alloc_display();
+
+		if (!out)
+			return -1;
+
+		out->bo_flags = disp_kms->bo_flags;
+		out->single_bo = disp_kms->single_bo;
+		out->dumb = disp_kms->dumb;
+		out->rotation = disp_kms->rotation;
+		out->cache_max = disp_kms->cache_max;
+		out->window = disp_kms->window;
+		out->win_x = disp_kms->win_x;
+		out->win_y = disp_kms->win_y;
+		out->win_w = disp_kms->win_w;
+		out->win_h = disp_kms->win_h;
+
+		out->connector[0] = disp_kms->connector[i];
+		out->connector[0].disp = &out->base;
+		out->connectors_count = 1;
+
+		*next = &out->base;
+		next = &out->base.next_output;
+	}
+
+	disp_kms->connectors_count = MIN(disp_kms->connectors_count, 1u);
+
+	return 0;
+}
+
+/* find the modes of the connectors, and size the display to fit them: */
+static int
+setup_display(struct display *disp, bool atomic)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t i;
+
+	disp->width = 0;
+	disp->height = 0;
+	disp->multiplanar = !disp_kms->single_bo && !disp_kms->dumb;
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *c = &disp_kms->connector[i];
+		connector_find_mode(disp, c);
+		if (c->mode == NULL)
+			continue;
+		if (!disp->wait_vblank) {
+			disp->wait_vblank = wait_vblank;
+			disp->refresh_num = c->mode->clock * 1000;
+			disp->refresh_den = c->mode->htotal * c->mode->vtotal;
+			disp_kms->vblank_pipe = c->pipe;
+		}
+		/* setup side-by-side virtual display */
+		c->x = disp->width;
+		disp->width += c->mode->hdisplay;
+		if (disp->height < c->mode->vdisplay) {
+			disp->height = c->mode->vdisplay;
+		}
+	}
+
+#ifdef HAVE_DRM_ATOMIC
+	if (atomic && atomic_init(disp))
+		return -1;
+#endif
+
+	MSG("using %d connectors, %dx%d display, multiplanar: %d",
+			disp_kms->connectors_count, disp->width, disp->height, disp->multiplanar);
+
+	pthread_mutex_lock(&lock);
+	list_append(&disp_kms->link, &displays);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+struct display *
+disp_kms_open(int argc, char **argv)
+{
+	struct display_kms *disp_kms = NULL;
+	struct display *disp, *out;
+	bool atomic = false, split = false;
+	int i;
+
+	disp_kms = alloc_display();
+	if (!disp_kms)
+		return NULL;
+	disp = &disp_kms->base;
+
 	/* note: set args to NULL after we've parsed them so other modules know
 	 * that it is already parsed (since the arg parsing is decentralized)
 	 */
@@ -526,6 +2453,8 @@ disp_kms_open(int argc, char **argv)
 		} else if (!strcmp("-s", argv[i])) {
 			struct connector *connector =
 					&disp_kms->connector[disp_kms->connectors_count++];
+			connector->disp = disp;
+			connector->out_fence = -1;
 			connector->crtc = -1;
 			argv[i++] = NULL;
 			if (sscanf(argv[i], "%d:%64s",
@@ -540,6 +2469,55 @@ disp_kms_open(int argc, char **argv)
 				goto fail;
 			}
 			disp_kms->bo_flags |= OMAP_BO_SCANOUT;
+		} else if (!strcmp("--single-bo", argv[i])) {
+			disp_kms->single_bo = true;
+		} else if (!strcmp("--dumb", argv[i])) {
+			disp_kms->dumb = true;
+		} else if (!strcmp("--rotate", argv[i])) {
+			argv[i++] = NULL;
+			if ((sscanf(argv[i], "%u", &disp_kms->rotation) != 1) ||
+					(disp_kms->rotation % 90) ||
+					(disp_kms->rotation >= 360)) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+		} else if (!strcmp("--split", argv[i])) {
+			split = true;
+#ifdef HAVE_DRM_ATOMIC
+		} else if (!strcmp("--atomic", argv[i])) {
+			atomic = true;
+#endif
+		} else if (!strcmp("--bo-cache", argv[i])) {
+			int n;
+			argv[i++] = NULL;
+			if ((sscanf(argv[i], "%d", &n) != 1) || (n < 0)) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+			disp_kms->cache_max = (uint64_t)n << 20;
+		} else if (!strcmp("--window", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u,%u,%ux%u", &disp_kms->win_x,
+					&disp_kms->win_y, &disp_kms->win_w,
+					&disp_kms->win_h) != 4 ||
+					!disp_kms->win_w || !disp_kms->win_h) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+			disp_kms->window = true;
+		} else if (!strcmp("--grid", argv[i])) {
+			uint32_t cols, rows;
+			argv[i++] = NULL;
+			if ((sscanf(argv[i], "%ux%u", &cols, &rows) != 2) ||
+					!cols || !rows) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+			/* for every stream: */
+			pthread_mutex_lock(&lock);
+			grid_cols = cols;
+			grid_rows = rows;
+			pthread_mutex_unlock(&lock);
 		} else {
 			/* ignore */
 			continue;
@@ -547,27 +2525,37 @@ disp_kms_open(int argc, char **argv)
 		argv[i] = NULL;
 	}
 
-	disp->width = 0;
-	disp->height = 0;
-	disp->multiplanar = true;
-	for (i = 0; i < (int)disp_kms->connectors_count; i++) {
-		struct connector *c = &disp_kms->connector[i];
-		connector_find_mode(disp, c);
-		if (c->mode == NULL)
-			continue;
-		/* setup side-by-side virtual display */
-		disp->width += c->mode->hdisplay;
-		if (disp->height < c->mode->vdisplay) {
-			disp->height = c->mode->vdisplay;
-		}
+	/* omapdrm rotates by scanning out a rotated view of the TILER
+	 * container, which linear buffers don't have:
+	 */
+	if (disp_kms->rotation && !disp_kms->dumb &&
+			!(disp_kms->bo_flags & OMAP_BO_TILED)) {
+		MSG("rotation needs tiled buffers, using -t auto");
+		disp_kms->bo_flags |= OMAP_BO_TILED;
 	}
 
-	MSG("using %d connectors, %dx%d display, multiplanar: %d",
-			disp_kms->connectors_count, disp->width, disp->height, disp->multiplanar);
+	/* planes of different bpp can't share a 2d tiled container: */
+	if (disp_kms->single_bo && (disp_kms->bo_flags & OMAP_BO_TILED)) {
+		MSG("--single-bo is not supported with tiled buffers, ignoring");
+		disp_kms->single_bo = false;
+	}
+
+	/* the kernel does not know the omap flags of dumb buffers: */
+	if (disp_kms->dumb && (disp_kms->bo_flags & OMAP_BO_TILED)) {
+		MSG("tiled buffers need omapdrm, using linear dumb buffers");
+		disp_kms->bo_flags &= ~OMAP_BO_TILED;
+	}
+
+	if (split && split_outputs(disp))
+		goto fail;
+
+	for (out = disp; out; out = out->next_output)
+		if (setup_display(out, atomic))
+			goto fail;
 
 	return disp;
 
 fail:
-	// XXX cleanup
+	free_display(disp);
 	return NULL;
 }
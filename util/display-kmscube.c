@@ -38,7 +38,6 @@
  * - Enable from command line only; no auto detect at open like x11/kms
  * - Cleanup display_kmscube options
  * - Implement the "post" functions so that cube faces are updated
- * - Do the necessary cleanup in the close function
  * - Remove the extra level of structure inside display_kmscube
  * - Cleanup commented out code
  * - Revisit disp pointer in struct drm_fb
@@ -59,6 +58,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
@@ -107,6 +107,9 @@ struct display_kmscube {
 	struct display base;
 	uint32_t bo_flags,
 		i;		// This is used to animate the cube.
+	struct hist *flip_hist;	/* page flip to completion */
+	uint64_t flip_t;	/* when the flip in flight was queued */
+	struct buffer *vid;	/* drawn into the frame being flipped to */
 
 	// GL.
 	struct {
@@ -127,16 +130,24 @@ struct display_kmscube {
 	struct {
 		struct gbm_device *dev;
 		struct gbm_surface *surface;
+		struct gbm_bo *bo;	/* locked front buffer, on screen */
+		struct gbm_bo *next;	/* being flipped to */
 	} gbm;
 
 	// DRM.
 	struct {
 		// Note: fd is in base display
+		drmModeRes *resources;
+		drmModeConnector *connector;	/* which the mode points into */
+		drmModeEncoder *encoder;
 		drmModeModeInfo *mode;
 		uint32_t crtc_id;
 		uint32_t connector_id;
 		drmModePlaneRes *plane_resources;
 	} drm;
+
+	/* every buffer allocated and not yet freed, to free them on close: */
+	struct list buffers;
 };
 
 /* All our buffers are only vid buffers, and they all have an EGLImage. */
@@ -145,6 +156,7 @@ struct buffer_kmscube {
 	struct buffer base;
 	uint32_t fb_id;
 	EGLImageKHR egl_img;
+	struct list link;	/* in display_kmscube::buffers */
 };
 
 struct drm_fb {
@@ -165,10 +177,13 @@ static int init_drm(struct display_kmscube *disp_kmsc)
 		ERROR("drmModeGetResources failed: %s", strerror(errno));
 		return -1;
 	}
+	disp_kmsc->drm.resources = resources;
 
 	/* find a connected connector: */
 	for (i = 0; i < resources->count_connectors; i++) {
 		connector = drmModeGetConnector(disp_kmsc->base.fd, resources->connectors[i]);
+		if (!connector)
+			continue;
 		if (connector->connection == DRM_MODE_CONNECTED) {
 			/* it's connected, let's use this! */
 			break;
@@ -184,6 +199,8 @@ static int init_drm(struct display_kmscube *disp_kmsc)
 		ERROR("no connected connector!");
 		return -1;
 	}
+	/* the mode is in the connector, so keep it until close: */
+	disp_kmsc->drm.connector = connector;
 
 	/* find highest resolution mode: */
 	for (i = 0, area = 0; i < connector->count_modes; i++) {
@@ -203,6 +220,8 @@ static int init_drm(struct display_kmscube *disp_kmsc)
 	/* find encoder: */
 	for (i = 0; i < resources->count_encoders; i++) {
 		encoder = drmModeGetEncoder(disp_kmsc->base.fd, resources->encoders[i]);
+		if (!encoder)
+			continue;
 		if (encoder->encoder_id == connector->encoder_id)
 			break;
 		drmModeFreeEncoder(encoder);
@@ -214,6 +233,7 @@ static int init_drm(struct display_kmscube *disp_kmsc)
 		return -1;
 	}
 
+	disp_kmsc->drm.encoder = encoder;
 	disp_kmsc->drm.crtc_id = encoder->crtc_id;
 	disp_kmsc->drm.connector_id = connector->connector_id;
 
@@ -696,16 +716,83 @@ static struct drm_fb * drm_fb_get_from_bo(struct display_kmscube *disp_kmsc, str
 	return fb;
 }
 
+/* give up waiting for a flip after: */
+#define FLIP_TIMEOUT_MS 3000
+
 static void page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
-	int *waiting_for_flip = data;
-	*waiting_for_flip = 0;
+	struct display_kmscube *disp_kmsc = data;
+
+	hist_record(disp_kmsc->flip_hist, time_ns() - disp_kmsc->flip_t);
+
+	/* release last buffer to render on again: */
+	gbm_surface_release_buffer(disp_kmsc->gbm.surface, disp_kmsc->gbm.bo);
+	disp_kmsc->gbm.bo = disp_kmsc->gbm.next;
+	disp_kmsc->gbm.next = NULL;
+
+	/* the frame the video was drawn into is rendered, so the GPU is done
+	 * reading the video buffer:
+	 */
+	if (disp_kmsc->vid) {
+		struct buffer *buf = disp_kmsc->vid;
+		disp_kmsc->vid = NULL;
+		disp_release_buffer(&disp_kmsc->base, buf);
+	}
+}
+
+static int
+dispatch(struct display *disp, int timeout_ms)
+{
+	drmEventContext evctx = {
+			.version = DRM_EVENT_CONTEXT_VERSION,
+			.page_flip_handler = page_flip_handler,
+	};
+	struct pollfd pfd = {
+			.fd = disp->fd,
+			.events = POLLIN,
+	};
+	int ret;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN))
+			return 0;
+		ERROR("poll failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (ret == 0)
+		return 0;
+
+	drmHandleEvent(disp->fd, &evctx);
+
+	return 1;
+}
+
+/* wait for the flip in flight, or with disp_set_nonblock(), fail with
+ * -EAGAIN if there is one:
+ */
+static int
+wait_flip(struct display *disp)
+{
+	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
+
+	while (disp_kmsc->gbm.next) {
+		if (disp->nonblock)
+			return -EAGAIN;
+		if (dispatch(disp, FLIP_TIMEOUT_MS) <= 0) {
+			ERROR("Timeout waiting for flip complete");
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 static struct omap_bo *
-alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
-		uint32_t *bo_handle, uint32_t *pitch)
+alloc_bo(struct display *disp, enum mem_purpose purpose, uint32_t bpp,
+		uint32_t width, uint32_t height, uint32_t *bo_handle, uint32_t *pitch)
 {
 	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
 	struct omap_bo *bo;
@@ -731,6 +818,7 @@ alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
 	}
 
 	if (bo) {
+		mem_track_bo(bo, purpose, bo_flags);
 		*bo_handle = omap_bo_handle(bo);
 		*pitch = width * bpp / 8;
 		if (bo_flags & OMAP_BO_TILED)
@@ -740,10 +828,45 @@ alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
 	return bo;
 }
 
+/* EGLImage YUV flags matching the colorspace of the video buffers */
+static EGLint
+yuv_flags(enum color_space cs)
+{
+	EGLint flags = 0;
+
+	flags |= color_is_full_range(cs) ?
+			EGLIMAGE_FLAGS_YUV_FULL_RANGE : EGLIMAGE_FLAGS_YUV_CONFORMANT_RANGE;
+	flags |= color_is_bt709(cs) ?
+			EGLIMAGE_FLAGS_YUV_BT709 : EGLIMAGE_FLAGS_YUV_BT601;
+
+	return flags;
+}
+
+static void
+free_buffer(struct display *disp, struct buffer *buf)
+{
+	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
+	struct buffer_kmscube *buf_kmsc = to_buffer_kmscube(buf);
+
+	list_del(&buf_kmsc->link);
+
+	if (buf_kmsc->egl_img != EGL_NO_IMAGE_KHR)
+		disp_kmsc->gl.eglDestroyImageKHR(disp_kmsc->gl.display,
+				buf_kmsc->egl_img);
+
+	if (buf->bo[0]) {
+		mem_untrack_bo(buf->bo[0]);
+		omap_bo_del(buf->bo[0]);
+	}
+
+	free(buf_kmsc);
+}
+
 /* We allocate single planar buffers, always. This, for EGLImage. Also, we
  * create on EGLImageKHR per buffer. */
 static struct buffer *
-alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
+alloc_buffer(struct display *disp, enum mem_purpose purpose,
+		uint32_t fourcc, uint32_t w, uint32_t h)
 {
 	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
 	struct buffer_kmscube *buf_kmsc;
@@ -757,6 +880,8 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		return NULL;
 	}
 	buf = &buf_kmsc->base;
+	buf_kmsc->egl_img = EGL_NO_IMAGE_KHR;
+	list_add(&buf_kmsc->link, &disp_kmsc->buffers);
 
 	buf->fourcc = fourcc;
 	buf->width = w;
@@ -771,23 +896,23 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 	switch(fourcc) {
 	case FOURCC('A','R','2','4'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 32, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, purpose, 32, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	case FOURCC('U','Y','V','Y'):
 	case FOURCC('Y','U','Y','V'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 16, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, purpose, 16, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	case FOURCC('N','V','1','2'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 8, buf->width, (buf->height + buf->height/2),
+		buf->bo[0] = alloc_bo(disp, purpose, 8, buf->width, (buf->height + buf->height/2),
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	case FOURCC('I','4','2','0'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 8, buf->width, (buf->height + buf->height/2),
+		buf->bo[0] = alloc_bo(disp, purpose, 8, buf->width, (buf->height + buf->height/2),
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	default:
@@ -795,6 +920,11 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		goto fail;
 	}
 
+	if (!buf->bo[0]) {
+		ERROR("allocation failed");
+		goto fail;
+	}
+
 	// Create EGLImage and return.
 	// TODO: cropping attributes when this will be supported.
 	EGLint attr[] = {
@@ -802,8 +932,7 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 	    EGL_GL_VIDEO_WIDTH_TI,       buf->width,
 	    EGL_GL_VIDEO_HEIGHT_TI,      buf->height,
 	    EGL_GL_VIDEO_BYTE_SIZE_TI,   omap_bo_size(buf->bo[0]),
-	    // TODO: pick proper YUV flags..
-	    EGL_GL_VIDEO_YUV_FLAGS_TI,   EGLIMAGE_FLAGS_YUV_CONFORMANT_RANGE | EGLIMAGE_FLAGS_YUV_BT601,
+	    EGL_GL_VIDEO_YUV_FLAGS_TI,   yuv_flags(disp->colorspace),
 	    EGL_NONE
 	};
 
@@ -815,18 +944,33 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 
 	if (buf_kmsc->egl_img == EGL_NO_IMAGE_KHR) {
 		ERROR("eglCreateImageKHR failed!\n");
-		return NULL;
+		goto fail;
 	}
 
 	return buf;
 
 fail:
-	// XXX cleanup
+	free_buffer(disp, buf);
 	return NULL;
 }
 
+static void
+free_buffers(struct display *disp, struct buffer **bufs, uint32_t n)
+{
+	uint32_t i;
+
+	if (!bufs)
+		return;
+
+	for (i = 0; i < n; i++)
+		if (bufs[i])
+			free_buffer(disp, bufs[i]);
+
+	free(bufs);
+}
+
 static struct buffer **
-alloc_buffers(struct display *disp, uint32_t n,
+alloc_buffers(struct display *disp, enum mem_purpose purpose, uint32_t n,
 		uint32_t fourcc, uint32_t w, uint32_t h)
 {
 	struct buffer **bufs;
@@ -839,7 +983,7 @@ alloc_buffers(struct display *disp, uint32_t n,
 	}
 
 	for (i = 0; i < n; i++) {
-		bufs[i] = alloc_buffer(disp, fourcc, w, h);
+		bufs[i] = alloc_buffer(disp, purpose, fourcc, w, h);
 		if (!bufs[i]) {
 			ERROR("allocation failed");
 			goto fail;
@@ -849,7 +993,7 @@ alloc_buffers(struct display *disp, uint32_t n,
 	return bufs;
 
 fail:
-	// XXX cleanup
+	free_buffers(disp, bufs, n);
 	return NULL;
 }
 
@@ -864,7 +1008,7 @@ static struct buffer **
 get_vid_buffers(struct display *disp, uint32_t n,
 		uint32_t fourcc, uint32_t w, uint32_t h)
 {
-	return alloc_buffers(disp, n, fourcc, w, h);
+	return alloc_buffers(disp, MEM_VIDEO, n, fourcc, w, h);
 }
 
 static int
@@ -932,20 +1076,15 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 
 	// TODO: For now, draw cube...
 
-	fd_set fds;
-	drmEventContext evctx = {
-			.version = DRM_EVENT_CONTEXT_VERSION,
-			.page_flip_handler = page_flip_handler,
-	};
-	struct gbm_bo *bo;
 	struct drm_fb *fb;
 	int ret;
 	struct gbm_bo *next_bo;
-	int waiting_for_flip = 1;
 
-	FD_ZERO(&fds);
-	FD_SET(0, &fds);
-	FD_SET(disp_kmsc->base.fd, &fds);
+	/* the surface has no buffer to render to until the flip completes: */
+	dispatch(disp, 0);
+	ret = wait_flip(disp);
+	if (ret)
+		return ret;
 
 	// Update video texture / EGL Image.
         disp_kmsc->gl.glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, buf_kmsc->egl_img);
@@ -956,10 +1095,12 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 	}
 
 	// Draw cube.
+	TRACE_BEGIN("render", buf);
 	draw(disp_kmsc);
 	(disp_kmsc->i)++;
 
 	eglSwapBuffers(disp_kmsc->gl.display, disp_kmsc->gl.surface);
+	TRACE_END("render", buf);
 	next_bo = gbm_surface_lock_front_buffer(disp_kmsc->gbm.surface);
 	fb = drm_fb_get_from_bo(disp_kmsc, next_bo);
 
@@ -969,37 +1110,88 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 	 */
 
 	ret = drmModePageFlip(disp_kmsc->base.fd, disp_kmsc->drm.crtc_id, fb->fb_id,
-			DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
+			DRM_MODE_PAGE_FLIP_EVENT, disp_kmsc);
 	if (ret) {
 		ERROR("failed to queue page flip: %s\n", strerror(errno));
+		gbm_surface_release_buffer(disp_kmsc->gbm.surface, next_bo);
 		return -1;
 	}
 
-	while (waiting_for_flip) {
-		ret = select(disp_kmsc->base.fd + 1, &fds, NULL, NULL, NULL);
-		if (ret < 0) {
-			ERROR("select err: %s\n", strerror(errno));
-			return ret;
-		} else if (ret == 0) {
-			ERROR("select timeout!\n");
-			return -1;
-		} else if (FD_ISSET(0, &fds)) {
-			ERROR("user interrupted!\n");
-			break;
+	disp_kmsc->gbm.next = next_bo;
+	disp_kmsc->vid = buf;
+	disp_kmsc->flip_t = time_ns();
+
+	/* nonblocking apps dispatch the flip event themselves: */
+	if (disp->nonblock)
+		return 0;
+
+	TRACE_BEGIN("flip wait", buf);
+	ret = wait_flip(disp);
+	TRACE_END("flip wait", buf);
+
+	return ret;
+}
+
+/* free everything, also used to unwind a partially opened display: */
+static void
+free_display(struct display *disp)
+{
+	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
+	struct buffer_kmscube *buf_kmsc, *tmp;
+
+	list_for_each_entry_safe(buf_kmsc, tmp, &disp_kmsc->buffers, link)
+		free_buffer(disp, &buf_kmsc->base);
+
+	if (disp_kmsc->gl.display != EGL_NO_DISPLAY) {
+		if (disp_kmsc->gl.context) {
+			if (disp_kmsc->gl.texture_name)
+				glDeleteTextures(1, &disp_kmsc->gl.texture_name);
+			if (disp_kmsc->gl.program)
+				glDeleteProgram(disp_kmsc->gl.program);
 		}
-		drmHandleEvent(disp_kmsc->base.fd, &evctx);
+		eglMakeCurrent(disp_kmsc->gl.display, EGL_NO_SURFACE,
+				EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (disp_kmsc->gl.surface != EGL_NO_SURFACE)
+			eglDestroySurface(disp_kmsc->gl.display, disp_kmsc->gl.surface);
+		if (disp_kmsc->gl.context)
+			eglDestroyContext(disp_kmsc->gl.display, disp_kmsc->gl.context);
+		eglTerminate(disp_kmsc->gl.display);
 	}
 
-	/* release last buffer to render on again: */
-	gbm_surface_release_buffer(disp_kmsc->gbm.surface, bo);
-	bo = next_bo;
-
-	return 0;
+	if (disp_kmsc->gbm.next)
+		gbm_surface_release_buffer(disp_kmsc->gbm.surface, disp_kmsc->gbm.next);
+	if (disp_kmsc->gbm.bo)
+		gbm_surface_release_buffer(disp_kmsc->gbm.surface, disp_kmsc->gbm.bo);
+	/* this also removes the fb's of the surface's bo's: */
+	if (disp_kmsc->gbm.surface)
+		gbm_surface_destroy(disp_kmsc->gbm.surface);
+	if (disp_kmsc->gbm.dev)
+		gbm_device_destroy(disp_kmsc->gbm.dev);
+
+	if (disp_kmsc->drm.plane_resources)
+		drmModeFreePlaneResources(disp_kmsc->drm.plane_resources);
+	if (disp_kmsc->drm.encoder)
+		drmModeFreeEncoder(disp_kmsc->drm.encoder);
+	if (disp_kmsc->drm.connector)
+		drmModeFreeConnector(disp_kmsc->drm.connector);
+	if (disp_kmsc->drm.resources)
+		drmModeFreeResources(disp_kmsc->drm.resources);
+
+	if (disp->dev)
+		omap_device_del(disp->dev);
+	if (disp->fd >= 0)
+		drmClose(disp->fd);
+
+	free(disp_kmsc);
 }
 
 static void
 close_kmscube(struct display *disp)
 {
+	/* so that no flip event arrives for a freed display: */
+	disp->nonblock = false;
+	wait_flip(disp);
+	free_display(disp);
 }
 
 void
@@ -1016,7 +1208,6 @@ disp_kmscube_open(int argc, char **argv)
 {
 	struct display_kmscube *disp_kmsc = NULL;
 	struct display *disp;
-	struct gbm_bo *bo;
 	struct drm_fb *fb;
 	int ret, i, enabled = 0;
 	float fov = 45, distance = 8;
@@ -1058,8 +1249,12 @@ disp_kmscube_open(int argc, char **argv)
 		ERROR("allocation failed");
 		goto fail;
 	}
+	disp_kmsc->flip_hist = hist_get("kmscube flip");
 	disp_kmsc->gl.distance = distance;
 	disp_kmsc->gl.fov = fov;
+	disp_kmsc->gl.display = EGL_NO_DISPLAY;
+	disp_kmsc->gl.surface = EGL_NO_SURFACE;
+	list_init(&disp_kmsc->buffers);
 	disp = &disp_kmsc->base;
 
 	disp->fd = drmOpen("omapdrm", NULL);
@@ -1079,6 +1274,8 @@ disp_kmscube_open(int argc, char **argv)
 	disp->post_buffer = post_buffer;
 	disp->post_vid_buffer = post_vid_buffer;
 	disp->close = close_kmscube;
+	disp->dispatch = dispatch;
+	disp->free_buffers = free_buffers;
 
 	if (init_drm(disp_kmsc)) {
 		ERROR("couldn't init drm");
@@ -1105,20 +1302,24 @@ disp_kmscube_open(int argc, char **argv)
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 	eglSwapBuffers(disp_kmsc->gl.display, disp_kmsc->gl.surface);
-	bo = gbm_surface_lock_front_buffer(disp_kmsc->gbm.surface);
-	fb = drm_fb_get_from_bo(disp_kmsc, bo);
+	disp_kmsc->gbm.bo = gbm_surface_lock_front_buffer(disp_kmsc->gbm.surface);
+	fb = drm_fb_get_from_bo(disp_kmsc, disp_kmsc->gbm.bo);
+	if (!fb)
+		goto fail;
 
 	/* set mode: */
 	ret = drmModeSetCrtc(disp_kmsc->base.fd, disp_kmsc->drm.crtc_id, fb->fb_id, 0, 0,
 			&disp_kmsc->drm.connector_id, 1, disp_kmsc->drm.mode);
 	if (ret) {
 		ERROR("failed to set mode: %s\n", strerror(errno));
-		return ret;
+		goto fail;
 	}
 
 	disp->width = 0;
 	disp->height = 0;
 	disp->multiplanar = false;
+	/* video buffers are textured from by the GPU: */
+	disp->cpu_sync = true;
 //	for (i = 0; i < (int)disp_kmsc->connectors_count; i++) {
 //		struct connector *c = &disp_kmsc->connector[i];
 //		connector_find_mode(disp, c);
@@ -1137,6 +1338,7 @@ disp_kmscube_open(int argc, char **argv)
 	return disp;
 
 fail:
-	// XXX cleanup
+	if (disp_kmsc)
+		free_display(&disp_kmsc->base);
 	return NULL;
 }
@@ -38,12 +38,16 @@ struct display_x11 {
 	struct display base;
 	Display *dpy;
 	Window win;
+
+	/* every buffer allocated and not yet freed, to free them on close: */
+	struct list buffers;
 };
 
 #define to_buffer_x11(x) container_of(x, struct buffer_x11, base)
 struct buffer_x11 {
 	struct buffer base;
-	DRI2Buffer *dri2buf;
+	DRI2Buffer dri2buf;
+	struct list link;	/* in display_x11::buffers */
 };
 
 
@@ -56,6 +60,36 @@ get_buffers(struct display *disp, uint32_t n)
 	return NULL;
 }
 
+static void
+free_buffer(struct display *disp, struct buffer *buf)
+{
+	struct buffer_x11 *buf_x11 = to_buffer_x11(buf);
+	int i;
+
+	list_del(&buf_x11->link);
+
+	for (i = 0; i < buf->nbo; i++)
+		if (buf->bo[i])
+			omap_bo_del(buf->bo[i]);
+
+	free(buf_x11);
+}
+
+static void
+free_buffers(struct display *disp, struct buffer **bufs, uint32_t n)
+{
+	uint32_t i;
+
+	if (!bufs)
+		return;
+
+	for (i = 0; i < n; i++)
+		if (bufs[i])
+			free_buffer(disp, bufs[i]);
+
+	free(bufs);
+}
+
 static struct buffer **
 get_vid_buffers(struct display *disp, uint32_t n,
 		uint32_t fourcc, uint32_t w, uint32_t h)
@@ -85,10 +119,16 @@ get_vid_buffers(struct display *disp, uint32_t n,
 
 	if (nbufs != n) {
 		ERROR("wrong number of bufs: %d vs %d", nbufs, n);
+		XFree(dri2bufs);
 		return NULL;
 	}
 
 	bufs = calloc(nbufs, sizeof(struct buffer *));
+	if (!bufs) {
+		ERROR("allocation failed");
+		XFree(dri2bufs);
+		return NULL;
+	}
 
 	for (i = 0; i < nbufs; i++) {
 		struct buffer *buf;
@@ -97,10 +137,13 @@ get_vid_buffers(struct display *disp, uint32_t n,
 		buf_x11 = calloc(1, sizeof(*buf_x11));
 		if (!buf_x11) {
 			ERROR("allocation failed");
+			free_buffers(disp, bufs, n);
+			XFree(dri2bufs);
 			return NULL;
 		}
 
-		buf_x11->dri2buf = &dri2bufs[i];
+		buf_x11->dri2buf = dri2bufs[i];
+		list_add(&buf_x11->link, &disp_x11->buffers);
 
 		buf = &buf_x11->base;
 
@@ -119,6 +162,8 @@ get_vid_buffers(struct display *disp, uint32_t n,
 		bufs[i] = buf;
 	}
 
+	XFree(dri2bufs);
+
 	return bufs;
 }
 
@@ -143,10 +188,12 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 			.y2 = y + h,
 	};
 
+	TRACE_BEGIN("swap buffers", buf);
 	DRI2SwapBuffersVid(disp_x11->dpy, disp_x11->win, 0, 0, 0, &count,
-			buf_x11->dri2buf->attachment, &b);
+			buf_x11->dri2buf.attachment, &b);
+	TRACE_END("swap buffers", buf);
 	DBG("DRI2SwapBuffersVid[%u]: count=%llu",
-			buf_x11->dri2buf->attachment, count);
+			buf_x11->dri2buf.attachment, count);
 
 	return 0;
 }
@@ -155,7 +202,21 @@ static void
 close_x11(struct display *disp)
 {
 	struct display_x11 *disp_x11 = to_display_x11(disp);
+	struct buffer_x11 *buf_x11, *tmp;
+
+	list_for_each_entry_safe(buf_x11, tmp, &disp_x11->buffers, link)
+		free_buffer(disp, &buf_x11->base);
+
+	/* the drm fd is authenticated once, and shared by all displays, so it
+	 * stays open:
+	 */
+	omap_device_del(disp->dev);
+
+	DRI2DestroyDrawable(disp_x11->dpy, disp_x11->win);
+	XDestroyWindow(disp_x11->dpy, disp_x11->win);
 	XCloseDisplay(disp_x11->dpy);
+
+	free(disp_x11);
 }
 
 void
@@ -278,6 +339,7 @@ disp_x11_open(int argc, char **argv)
 	}
 
 	disp = &disp_x11->base;
+	list_init(&disp_x11->buffers);
 
 	if (!global_fd) {
 		MSG("opening device: %s", device);
@@ -312,7 +374,10 @@ disp_x11_open(int argc, char **argv)
 	disp->post_buffer = post_buffer;
 	disp->post_vid_buffer = post_vid_buffer;
 	disp->close = close_x11;
+	disp->free_buffers = free_buffers;
 	disp->multiplanar = false;
+	/* DRI2 blits attach no dma-buf fences: */
+	disp->cpu_sync = true;
 
 	/* note: set args to NULL after we've parsed them so other modules know
 	 * that it is already parsed (since the arg parsing is decentralized)
@@ -373,15 +438,22 @@ disp_x11_open(int argc, char **argv)
 
 	MSG("Got CSC matrix:");
 	print_hex(i*4, (const unsigned char *)pval);
-
-	// XXX
+	XFree(pval);
+	XFree(formats);
+	XFree(driver);
+	XFree(device);
 
 	return disp;
 
 no_x11_free:
+	if (disp->dev)
+		omap_device_del(disp->dev);
+	free(disp_x11);
 	XFree(driver);
 	XFree(device);
 no_x11:
+	if (dpy)
+		XCloseDisplay(dpy);
 	ERROR("unimplemented");
 	return NULL;
 }
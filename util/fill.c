@@ -0,0 +1,723 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define HAVE_FILL_SSE2 1
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define HAVE_FILL_NEON 1
+#  if !defined(__aarch64__)
+#    include <sys/auxv.h>
+#    include <asm/hwcap.h>
+#  endif
+#endif
+
+/* The test pattern is a function of (n+i+j) only:
+ *
+ *   rgb = 0x00130502 * (quot >> 6) + 0x000a1120 * (rem >> 6)
+ *
+ * where quot/rem is (n+i+j) divided by the width.  So the color only changes
+ * every 64 pixels (or when rem wraps), and the fast paths below compute it
+ * once per run and then just splat it across the run.  The per-pixel "ref"
+ * implementation is kept around to validate and benchmark against.
+ */
+
+struct fill_impl {
+	const char *name;
+	bool (*supported)(void);
+	/* store cnt copies of val, NULL for the per-pixel reference path: */
+	void (*splat16)(uint16_t *p, uint16_t val, int cnt);
+	void (*splat32)(uint32_t *p, uint32_t val, int cnt);
+};
+
+static inline uint32_t
+pattern(int s, int width, int *run)
+{
+	div_t d = div(s, width);
+	/* number of pixels until either rem>>6 or quot changes: */
+	*run = MIN((d.rem | 63) + 1, width) - d.rem;
+	return 0x00130502 * (d.quot >> 6) + 0x000a1120 * (d.rem >> 6);
+}
+
+/*
+ * Reference (per-pixel) implementation:
+ */
+
+/* stolen from modetest.c */
+static void
+fillRGB4(char *virtual, int n, int width, int height, int stride)
+{
+	int i, j;
+	/* paint the buffer with colored tiles */
+	for (j = 0; j < height; j++) {
+		uint32_t *fb_ptr = (uint32_t*)((char*)virtual + j * stride);
+		for (i = 0; i < width; i++) {
+			div_t d = div(n+i+j, width);
+			fb_ptr[i] =
+					0x00130502 * (d.quot >> 6) +
+					0x000a1120 * (d.rem >> 6);
+		}
+	}
+}
+
+static void
+fill420(const struct color_conv *cc,
+		unsigned char *y, unsigned char *u, unsigned char *v,
+		int cs /*chroma pixel stride */,
+		int n, int width, int height, int stride)
+{
+	int i, j;
+
+	/* paint the buffer with colored tiles, in blocks of 2x2 */
+	for (j = 0; j < height; j+=2) {
+		unsigned char *y1p = y + j * stride;
+		unsigned char *y2p = y1p + stride;
+		unsigned char *up = u + (j/2) * stride * cs / 2;
+		unsigned char *vp = v + (j/2) * stride * cs / 2;
+
+		for (i = 0; i < width; i+=2) {
+			div_t d = div(n+i+j, width);
+			uint32_t rgb = 0x00130502 * (d.quot >> 6) + 0x000a1120 * (d.rem >> 6);
+			unsigned char y;
+
+			color_rgb2yuv(cc, rgb, &y, up, vp);
+
+			*(y2p++) = *(y1p++) = y;
+			*(y2p++) = *(y1p++) = y;
+
+			up += cs;
+			vp += cs;
+		}
+	}
+}
+
+/* note: YUYV packs two pixels per 32bit macropixel, so a line is width/2
+ * macropixels (writing width of them would run past the end of the line)
+ */
+static void
+fill422(const struct color_conv *cc, unsigned char *virtual,
+		int n, int width, int height, int stride)
+{
+	int i, j;
+	/* paint the buffer with colored tiles */
+	for (j = 0; j < height; j++) {
+		uint8_t *ptr = (uint8_t*)((char*)virtual + j * stride);
+		for (i = 0; i < width / 2; i++) {
+			div_t d = div(n+i+j, width);
+			uint32_t rgb = 0x00130502 * (d.quot >> 6) + 0x000a1120 * (d.rem >> 6);
+
+			color_rgb2yuv(cc, rgb, &ptr[0], &ptr[1], &ptr[3]);
+			ptr[2] = ptr[0];
+			ptr += 4;
+		}
+	}
+}
+
+/*
+ * Run based implementation, the store helpers are what gets vectorized:
+ */
+
+static void
+fillRGB4_runs(const struct fill_impl *impl, char *virtual,
+		int n, int width, int height, int stride)
+{
+	int i, j, cnt;
+
+	for (j = 0; j < height; j++) {
+		uint32_t *fb_ptr = (uint32_t*)((char*)virtual + j * stride);
+		for (i = 0; i < width; i += cnt) {
+			uint32_t rgb = pattern(n+i+j, width, &cnt);
+			cnt = MIN(cnt, width - i);
+			impl->splat32(&fb_ptr[i], rgb, cnt);
+		}
+	}
+}
+
+static void
+fill420_runs(const struct fill_impl *impl, const struct color_conv *cc,
+		unsigned char *y, unsigned char *u, unsigned char *v,
+		int cs /*chroma pixel stride */,
+		int n, int width, int height, int stride)
+{
+	int npairs = (width + 1) / 2;
+	int i, j, cnt;
+
+	for (j = 0; j < height; j+=2) {
+		unsigned char *y1p = y + j * stride;
+		unsigned char *y2p = y1p + stride;
+		unsigned char *up = u + (j/2) * stride * cs / 2;
+		unsigned char *vp = v + (j/2) * stride * cs / 2;
+
+		/* i counts 2x2 blocks, so (n+i+j) advances by two per block: */
+		for (i = 0; i < npairs; i += cnt) {
+			unsigned char yuv[3];
+			uint32_t rgb = pattern(n+(2*i)+j, width, &cnt);
+
+			cnt = MIN((cnt + 1) / 2, npairs - i);
+			color_rgb2yuv(cc, rgb, &yuv[0], &yuv[1], &yuv[2]);
+
+			memset(&y1p[2*i], yuv[0], 2 * cnt);
+			memset(&y2p[2*i], yuv[0], 2 * cnt);
+
+			if (cs == 1) {
+				memset(&up[i], yuv[1], cnt);
+				memset(&vp[i], yuv[2], cnt);
+			} else if ((cs == 2) && (vp == up + 1)) {
+				uint16_t uv;
+				memcpy(&uv, &yuv[1], sizeof(uv));
+				impl->splat16((uint16_t *)&up[2*i], uv, cnt);
+			} else {
+				int k;
+				for (k = i; k < i + cnt; k++) {
+					up[k * cs] = yuv[1];
+					vp[k * cs] = yuv[2];
+				}
+			}
+		}
+	}
+}
+
+static void
+fill422_runs(const struct fill_impl *impl, const struct color_conv *cc,
+		unsigned char *virtual,
+		int n, int width, int height, int stride)
+{
+	int nmacro = width / 2;
+	int i, j, cnt;
+
+	for (j = 0; j < height; j++) {
+		uint32_t *ptr = (uint32_t*)((char*)virtual + j * stride);
+		for (i = 0; i < nmacro; i += cnt) {
+			unsigned char yuyv[4];
+			uint32_t rgb = pattern(n+i+j, width, &cnt);
+			uint32_t val;
+
+			cnt = MIN(cnt, nmacro - i);
+			color_rgb2yuv(cc, rgb, &yuyv[0], &yuyv[1], &yuyv[3]);
+			yuyv[2] = yuyv[0];
+			memcpy(&val, yuyv, sizeof(val));
+			impl->splat32(&ptr[i], val, cnt);
+		}
+	}
+}
+
+/*
+ * Template based implementation:
+ *
+ * As long as quot>>6 stays zero, ie. (n+i+j) < 64*width, the pattern is
+ * periodic in (n+i+j) with a period of width.  So every line is just a
+ * window into one precomputed line, and frame n+1 is frame n scrolled by
+ * one pixel.  The template lines are built once per format and width, and
+ * after that each row of each frame is a single memcpy().
+ */
+
+struct fill_template {
+	struct list node;
+	const struct color_conv *cc;
+	uint32_t fourcc;
+	int width;
+	/* 4:2:0 works in 2x2 blocks, so (n+i+j) advances in steps of two and
+	 * there is one set of lines per parity of n:
+	 */
+	unsigned char *luma[2];
+	unsigned char *chroma[2][2];
+};
+
+static struct list templates = { &templates, &templates };
+static bool use_templates;
+
+static inline uint32_t
+pattern_at(int s, int width)
+{
+	int run;
+	return pattern(s % width, width, &run);
+}
+
+static void
+template_free(struct fill_template *tmpl)
+{
+	int p;
+
+	list_del(&tmpl->node);
+	for (p = 0; p < 2; p++) {
+		free(tmpl->luma[p]);
+		free(tmpl->chroma[p][0]);
+		free(tmpl->chroma[p][1]);
+	}
+	free(tmpl);
+}
+
+static struct fill_template *
+template_new(const struct color_conv *cc, uint32_t fourcc, int width)
+{
+	struct fill_template *tmpl;
+	int npairs = (width + 1) / 2;
+	int p, t;
+
+	tmpl = calloc(1, sizeof(*tmpl));
+	if (!tmpl) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+
+	list_init(&tmpl->node);
+	tmpl->cc = cc;
+	tmpl->fourcc = fourcc;
+	tmpl->width = width;
+
+	switch(fourcc) {
+	case 0: {
+		uint32_t *line = malloc(2 * width * sizeof(*line));
+		if (!line)
+			goto fail;
+		for (t = 0; t < 2 * width; t++)
+			line[t] = pattern_at(t, width);
+		tmpl->luma[0] = (unsigned char *)line;
+		break;
+	}
+	case FOURCC('Y','U','Y','V'): {
+		unsigned char *line = malloc(4 * (width + width / 2));
+		if (!line)
+			goto fail;
+		for (t = 0; t < width + width / 2; t++) {
+			unsigned char *yuyv = &line[4 * t];
+			color_rgb2yuv(cc, pattern_at(t, width), &yuyv[0], &yuyv[1], &yuyv[3]);
+			yuyv[2] = yuyv[0];
+		}
+		tmpl->luma[0] = line;
+		break;
+	}
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'): {
+		bool nv12 = (fourcc == FOURCC('N','V','1','2'));
+		for (p = 0; p < 2; p++) {
+			unsigned char *y, *u, *v;
+
+			y = tmpl->luma[p] = malloc(2 * width + 2 * npairs);
+			u = tmpl->chroma[p][0] = malloc(2 * (width + npairs));
+			v = tmpl->chroma[p][1] = malloc(width + npairs);
+			if (!y || !u || !v)
+				goto fail;
+
+			for (t = 0; t < (2 * width) + (2 * npairs); t += 2) {
+				unsigned char yuv[3];
+				color_rgb2yuv(cc, pattern_at(p + t, width), &yuv[0], &yuv[1], &yuv[2]);
+				y[t] = y[t + 1] = yuv[0];
+			}
+
+			for (t = 0; t < width + npairs; t++) {
+				unsigned char yuv[3];
+				color_rgb2yuv(cc, pattern_at(p + (2 * t), width), &yuv[0], &yuv[1], &yuv[2]);
+				if (nv12) {
+					u[2 * t] = yuv[1];
+					u[2 * t + 1] = yuv[2];
+				} else {
+					u[t] = yuv[1];
+					v[t] = yuv[2];
+				}
+			}
+		}
+		break;
+	}
+	default:
+		goto fail;
+	}
+
+	return tmpl;
+
+fail:
+	template_free(tmpl);
+	return NULL;
+}
+
+static struct fill_template *
+template_get(const struct color_conv *cc, struct buffer *buf, int n)
+{
+	struct fill_template *tmpl;
+	int width = buf->width;
+
+	/* only valid while quot>>6 is zero for every pixel: */
+	if ((n < 0) || (n + (int)buf->height + width >= 64 * width))
+		return NULL;
+
+	list_for_each_entry(tmpl, &templates, node) {
+		if ((tmpl->fourcc == buf->fourcc) && (tmpl->width == width) &&
+				(tmpl->cc == cc))
+			return tmpl;
+	}
+
+	tmpl = template_new(cc, buf->fourcc, width);
+	if (tmpl) {
+		DBG("fill: new template for %.4s, width=%d",
+				buf->fourcc ? (char *)&buf->fourcc : "RGB4", width);
+		list_add(&tmpl->node, &templates);
+	}
+
+	return tmpl;
+}
+
+static void
+fill_template(struct fill_template *tmpl, void **planes, int n,
+		int width, int j0, int j1, int stride)
+{
+	int npairs = (width + 1) / 2;
+	int j;
+
+	switch(tmpl->fourcc) {
+	case 0:
+		for (j = j0; j < j1; j++) {
+			memcpy((char *)planes[0] + j * stride,
+					tmpl->luma[0] + 4 * ((n + j) % width), 4 * width);
+		}
+		break;
+	case FOURCC('Y','U','Y','V'):
+		for (j = j0; j < j1; j++) {
+			memcpy((char *)planes[0] + j * stride,
+					tmpl->luma[0] + 4 * ((n + j) % width), 4 * (width / 2));
+		}
+		break;
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'): {
+		int cs = (tmpl->fourcc == FOURCC('N','V','1','2')) ? 2 : 1;
+		int p = n & 1;
+		for (j = j0; j < j1; j += 2) {
+			/* (n+j-p) is even, so these start on a block boundary: */
+			int t = (n + j - p) % (2 * width);
+			int m = ((n + j - p) / 2) % width;
+			unsigned char *y1p = (unsigned char *)planes[0] + j * stride;
+			unsigned char *up = (unsigned char *)planes[1] + (j/2) * stride * cs / 2;
+			unsigned char *vp = (unsigned char *)planes[2] + (j/2) * stride * cs / 2;
+
+			memcpy(y1p, tmpl->luma[p] + t, 2 * npairs);
+			memcpy(y1p + stride, tmpl->luma[p] + t, 2 * npairs);
+
+			if (cs == 2) {
+				memcpy(up, tmpl->chroma[p][0] + 2 * m, 2 * npairs);
+			} else {
+				memcpy(up, tmpl->chroma[p][0] + m, npairs);
+				memcpy(vp, tmpl->chroma[p][1] + m, npairs);
+			}
+		}
+		break;
+	}
+	}
+}
+
+/*
+ * Store helpers:
+ */
+
+static bool
+supported_always(void)
+{
+	return true;
+}
+
+static void
+splat16_c(uint16_t *p, uint16_t val, int cnt)
+{
+	while (cnt-- > 0)
+		*(p++) = val;
+}
+
+static void
+splat32_c(uint32_t *p, uint32_t val, int cnt)
+{
+	while (cnt-- > 0)
+		*(p++) = val;
+}
+
+#ifdef HAVE_FILL_SSE2
+static bool
+supported_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static void
+splat16_sse2(uint16_t *p, uint16_t val, int cnt)
+{
+	__m128i v = _mm_set1_epi16(val);
+	for (; (cnt > 0) && ((uintptr_t)p & 15); cnt--)
+		*(p++) = val;
+	for (; cnt >= 8; cnt -= 8, p += 8)
+		_mm_store_si128((__m128i *)p, v);
+	splat16_c(p, val, cnt);
+}
+
+static void
+splat32_sse2(uint32_t *p, uint32_t val, int cnt)
+{
+	__m128i v = _mm_set1_epi32(val);
+	for (; (cnt > 0) && ((uintptr_t)p & 15); cnt--)
+		*(p++) = val;
+	for (; cnt >= 4; cnt -= 4, p += 4)
+		_mm_store_si128((__m128i *)p, v);
+	splat32_c(p, val, cnt);
+}
+#endif
+
+#ifdef HAVE_FILL_NEON
+static bool
+supported_neon(void)
+{
+#ifdef __aarch64__
+	return true;
+#else
+	return !!(getauxval(AT_HWCAP) & HWCAP_NEON);
+#endif
+}
+
+static void
+splat16_neon(uint16_t *p, uint16_t val, int cnt)
+{
+	uint16x8_t v = vdupq_n_u16(val);
+	for (; cnt >= 8; cnt -= 8, p += 8)
+		vst1q_u16(p, v);
+	splat16_c(p, val, cnt);
+}
+
+static void
+splat32_neon(uint32_t *p, uint32_t val, int cnt)
+{
+	uint32x4_t v = vdupq_n_u32(val);
+	for (; cnt >= 4; cnt -= 4, p += 4)
+		vst1q_u32(p, v);
+	splat32_c(p, val, cnt);
+}
+#endif
+
+/* in increasing order of preference: */
+static const struct fill_impl impls[] = {
+		{ "ref",  supported_always, NULL, NULL },
+		{ "c",    supported_always, splat16_c, splat32_c },
+#ifdef HAVE_FILL_SSE2
+		{ "sse2", supported_sse2, splat16_sse2, splat32_sse2 },
+#endif
+#ifdef HAVE_FILL_NEON
+		{ "neon", supported_neon, splat16_neon, splat32_neon },
+#endif
+};
+
+static const struct fill_impl *impl;
+static struct workers *pool;
+
+int
+fill_select(const char *name)
+{
+	int i;
+
+	for (i = ARRAY_SIZE(impls) - 1; i >= 0; i--) {
+		if (name && strcmp(name, impls[i].name))
+			continue;
+		if (impls[i].supported()) {
+			impl = &impls[i];
+			DBG("fill: using %s implementation", impl->name);
+			return 0;
+		}
+		/* an explicitly requested implementation has no fallback: */
+		if (name)
+			break;
+	}
+
+	return -1;
+}
+
+const char *
+fill_impl_name(void)
+{
+	if (!impl)
+		fill_select(NULL);
+	return impl->name;
+}
+
+int
+fill_set_threads(int n)
+{
+	workers_free(pool);
+	pool = NULL;
+
+	if (n != 1) {
+		pool = workers_new(n);
+		if (!pool)
+			return -1;
+	}
+
+	return 0;
+}
+
+int
+fill_get_threads(void)
+{
+	return workers_count(pool);
+}
+
+void
+fill_set_template(bool enable)
+{
+	struct fill_template *tmpl, *tmp;
+
+	use_templates = enable;
+
+	if (!enable) {
+		list_for_each_entry_safe(tmpl, tmp, &templates, node)
+			template_free(tmpl);
+	}
+}
+
+struct fill_job {
+	struct buffer *buf;
+	const struct color_conv *cc;
+	struct fill_template *tmpl;
+	int n;
+	void *planes[3];
+};
+
+/* fill rows [j0, j1) of the buffer.  Since the pattern is a function of
+ * (n+i+j), a band is just a smaller buffer starting at row j0 filled
+ * with n+j0.
+ */
+static void
+fill_rows(struct fill_job *job, int j0, int j1)
+{
+	struct buffer *buf = job->buf;
+	int n = job->n + j0, h = j1 - j0;
+	uint32_t stride = buf->pitches[0];
+
+	if (job->tmpl) {
+		fill_template(job->tmpl, job->planes, job->n,
+				buf->width, j0, j1, stride);
+		return;
+	}
+
+	switch(buf->fourcc) {
+	case 0: {
+		char *virtual = (char *)job->planes[0] + j0 * stride;
+		if (impl->splat32) {
+			fillRGB4_runs(impl, virtual, n, buf->width, h, stride);
+		} else {
+			fillRGB4(virtual, n, buf->width, h, stride);
+		}
+		break;
+	}
+	case FOURCC('Y','U','Y','V'): {
+		unsigned char *virtual = (unsigned char *)job->planes[0] + j0 * stride;
+		if (impl->splat32) {
+			fill422_runs(impl, job->cc, virtual, n, buf->width, h, stride);
+		} else {
+			fill422(job->cc, virtual, n, buf->width, h, stride);
+		}
+		break;
+	}
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'): {
+		int cs = (buf->fourcc == FOURCC('N','V','1','2')) ? 2 : 1;
+		uint32_t coff = (j0/2) * stride * cs / 2;
+		unsigned char *y, *u, *v;
+		y = (unsigned char *)job->planes[0] + j0 * stride;
+		u = (unsigned char *)job->planes[1] + coff;
+		v = (unsigned char *)job->planes[2] + coff;
+		if (impl->splat16) {
+			fill420_runs(impl, job->cc, y, u, v, cs, n, buf->width, h, stride);
+		} else {
+			fill420(job->cc, y, u, v, cs, n, buf->width, h, stride);
+		}
+		break;
+	}
+	}
+}
+
+static void
+fill_band(void *arg, int idx, int cnt)
+{
+	struct fill_job *job = arg;
+	int height = job->buf->height;
+	/* keep bands on even rows, for the 2x2 blocks of 4:2:0 */
+	int j0 = ((height * idx) / cnt) & ~1;
+	int j1 = (idx == (cnt - 1)) ? height : ((height * (idx + 1)) / cnt) & ~1;
+
+	if (j1 > j0)
+		fill_rows(job, j0, j1);
+}
+
+void
+fill(struct buffer *buf, int n)
+{
+	static struct hist *hist;
+	struct fill_job job = {
+			.buf = buf,
+			.cc = color_get(buf->colorspace),
+			.n = n,
+	};
+	uint64_t t;
+	int i;
+
+	/* the planes may be in separate bo's, or all in one.  Checked before
+	 * anything is timed or traced:
+	 */
+	switch(buf->fourcc) {
+	case 0:
+	case FOURCC('Y','U','Y','V'):
+		job.planes[0] = buffer_plane(buf, 0);
+		break;
+	case FOURCC('N','V','1','2'):
+		job.planes[0] = buffer_plane(buf, 0);
+		job.planes[1] = buffer_plane(buf, 1);
+		job.planes[2] = (char *)job.planes[1] + 1;
+		break;
+	case FOURCC('I','4','2','0'):
+		job.planes[0] = buffer_plane(buf, 0);
+		job.planes[1] = buffer_plane(buf, 1);
+		job.planes[2] = buffer_plane(buf, 2);
+		break;
+	default:
+		ERROR("invalid format: 0x%08x", buf->fourcc);
+		return;
+	}
+
+	if (!hist)
+		hist = hist_get("fill");
+
+	t = time_ns();
+	TRACE_BEGIN("fill", buf);
+
+	if (!impl)
+		fill_select(NULL);
+
+	if (use_templates)
+		job.tmpl = template_get(job.cc, buf, n);
+
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_WRITE);
+
+	workers_run(pool, fill_band, &job);
+
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_WRITE);
+
+	hist_record(hist, time_ns() - t);
+	TRACE_END("fill", buf);
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+
+/* Log-linear buckets: values below 2^SUB_BITS get a bucket each, above that
+ * every power of two is split in 2^SUB_BITS buckets, so the error of a
+ * percentile is below 1/2^SUB_BITS (~6%) whatever the magnitude.
+ */
+#define SUB_BITS	4
+#define SUB_CNT		(1 << SUB_BITS)
+#define NBUCKETS	((64 - SUB_BITS + 1) * SUB_CNT)
+
+struct hist {
+	struct hist *next;
+	char name[32];
+	uint64_t count, sum, max;
+	uint32_t buckets[NBUCKETS];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hist *hists, **hists_tail = &hists;
+
+static int
+to_bucket(uint64_t ns)
+{
+	int shift;
+
+	if (ns < SUB_CNT)
+		return ns;
+
+	shift = (63 - __builtin_clzll(ns)) - SUB_BITS;
+
+	return ((shift + 1) * SUB_CNT) + ((ns >> shift) & (SUB_CNT - 1));
+}
+
+/* the largest value that falls in the bucket: */
+static uint64_t
+from_bucket(int b)
+{
+	int shift;
+
+	if (b < SUB_CNT)
+		return b;
+
+	shift = (b / SUB_CNT) - 1;
+
+	return ((((uint64_t)SUB_CNT + (b % SUB_CNT)) + 1) << shift) - 1;
+}
+
+struct hist *
+hist_get(const char *fmt, ...)
+{
+	struct hist *hist;
+	char name[sizeof(hist->name)];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&lock);
+
+	for (hist = hists; hist; hist = hist->next)
+		if (!strcmp(hist->name, name))
+			goto out;
+
+	hist = calloc(1, sizeof(*hist));
+	if (!hist) {
+		ERROR("allocation failed");
+		goto out;
+	}
+
+	strcpy(hist->name, name);
+	*hists_tail = hist;
+	hists_tail = &hist->next;
+
+out:
+	pthread_mutex_unlock(&lock);
+
+	return hist;
+}
+
+void
+hist_record(struct hist *hist, uint64_t ns)
+{
+	uint64_t max;
+
+	if (!hist)
+		return;
+
+	__atomic_fetch_add(&hist->buckets[to_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while ((ns > max) && !__atomic_compare_exchange_n(&hist->max, &max, ns,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+/* percentile p (0..100) from the counts snapshot: */
+static uint64_t
+percentile(const struct hist *hist, const uint32_t *buckets,
+		uint64_t count, int p)
+{
+	uint64_t target = ((count * p) + 99) / 100, seen = 0;
+	int b;
+
+	for (b = 0; b < NBUCKETS; b++) {
+		seen += buckets[b];
+		if (seen >= target)
+			return MIN(from_bucket(b), hist->max);
+	}
+
+	return hist->max;
+}
+
+void
+hist_report(FILE *f)
+{
+	static uint32_t buckets[NBUCKETS];
+	struct hist *hist;
+
+	pthread_mutex_lock(&lock);
+
+	fprintf(f, "latency (us):              count     avg     p50     p90     p99     max\n");
+
+	for (hist = hists; hist; hist = hist->next) {
+		uint64_t count = 0;
+		int b;
+
+		/* recording may still be going on, so work on a snapshot: */
+		for (b = 0; b < NBUCKETS; b++) {
+			buckets[b] = __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+			count += buckets[b];
+		}
+
+		if (!count)
+			continue;
+
+		fprintf(f, "  %-22s %8llu %7.1f %7.1f %7.1f %7.1f %7.1f\n", hist->name,
+				(unsigned long long)count,
+				(double)hist->sum / hist->count / 1000.0,
+				percentile(hist, buckets, count, 50) / 1000.0,
+				percentile(hist, buckets, count, 90) / 1000.0,
+				percentile(hist, buckets, count, 99) / 1000.0,
+				hist->max / 1000.0);
+	}
+
+	pthread_mutex_unlock(&lock);
+	fflush(f);
+}
+
+static void
+report_at_exit(void)
+{
+	hist_report(stderr);
+}
+
+int
+hist_enable_report(void)
+{
+	static bool enabled;
+
+	if (enabled)
+		return 0;
+
+	if (atexit(report_at_exit))
+		return -1;
+
+	enabled = true;
+
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+/* Accounting of the bo's we allocate, by purpose and tiling mode.  The size
+ * is what omap_bo_size() reports, which for tiled bo's is the size of the
+ * whole TILER container, ie. what is really pinned.
+ */
+
+enum tiling {
+	TILING_NONE, TILING_8, TILING_16, TILING_32, TILING_CNT,
+};
+
+static const char *purpose_names[MEM_PURPOSE_CNT] = {
+		[MEM_SCANOUT] = "scanout",
+		[MEM_VIDEO]   = "video",
+		[MEM_INPUT]   = "input",
+};
+
+static const char *tiling_names[TILING_CNT] = {
+		[TILING_NONE] = "none",
+		[TILING_8]    = "8",
+		[TILING_16]   = "16",
+		[TILING_32]   = "32",
+};
+
+struct mem_bucket {
+	uint32_t count;
+	uint64_t bytes, peak;
+};
+
+struct mem_entry {
+	struct omap_bo *bo;
+	struct mem_bucket *bucket;
+	uint32_t size;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mem_bucket buckets[MEM_PURPOSE_CNT][TILING_CNT];
+static struct mem_bucket total;
+
+/* the tracked bo's, it is a short list: */
+static struct mem_entry *entries;
+static uint32_t nentries, maxentries;
+
+static bool json;
+static volatile sig_atomic_t report_requested;
+
+static enum tiling
+to_tiling(uint32_t flags)
+{
+	switch (flags & OMAP_BO_TILED) {
+	case OMAP_BO_TILED_8:
+		return TILING_8;
+	case OMAP_BO_TILED_16:
+		return TILING_16;
+	case OMAP_BO_TILED_32:
+		return TILING_32;
+	default:
+		return TILING_NONE;
+	}
+}
+
+static void
+bucket_add(struct mem_bucket *bucket, int64_t size)
+{
+	bucket->count += (size > 0) ? 1 : -1;
+	bucket->bytes += size;
+	if (bucket->bytes > bucket->peak)
+		bucket->peak = bucket->bytes;
+}
+
+void
+mem_track_bo(struct omap_bo *bo, enum mem_purpose purpose, uint32_t flags)
+{
+	struct mem_entry *entry;
+
+	if (!bo)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	if (nentries == maxentries) {
+		uint32_t n = maxentries ? maxentries * 2 : 64;
+		entry = realloc(entries, n * sizeof(*entries));
+		if (!entry) {
+			pthread_mutex_unlock(&lock);
+			ERROR("allocation failed");
+			return;
+		}
+		entries = entry;
+		maxentries = n;
+	}
+
+	entry = &entries[nentries++];
+	entry->bo = bo;
+	entry->bucket = &buckets[purpose][to_tiling(flags)];
+	entry->size = omap_bo_size(bo);
+
+	bucket_add(entry->bucket, entry->size);
+	bucket_add(&total, entry->size);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void
+mem_untrack_bo(struct omap_bo *bo)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&lock);
+
+	for (i = 0; i < nentries; i++) {
+		struct mem_entry *entry = &entries[i];
+
+		if (entry->bo != bo)
+			continue;
+
+		bucket_add(entry->bucket, -(int64_t)entry->size);
+		bucket_add(&total, -(int64_t)entry->size);
+		*entry = entries[--nentries];
+		break;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+uint64_t
+mem_current_bytes(void)
+{
+	uint64_t bytes;
+
+	pthread_mutex_lock(&lock);
+	bytes = total.bytes;
+	pthread_mutex_unlock(&lock);
+
+	return bytes;
+}
+
+uint64_t
+mem_peak_bytes(void)
+{
+	uint64_t bytes;
+
+	pthread_mutex_lock(&lock);
+	bytes = total.peak;
+	pthread_mutex_unlock(&lock);
+
+	return bytes;
+}
+
+static void
+report_text(FILE *f)
+{
+	int p, t;
+
+	fprintf(f, "bo memory: %llu KiB in %u bo's, peak %llu KiB\n",
+			(unsigned long long)total.bytes / 1024, total.count,
+			(unsigned long long)total.peak / 1024);
+
+	for (p = 0; p < MEM_PURPOSE_CNT; p++) {
+		for (t = 0; t < TILING_CNT; t++) {
+			struct mem_bucket *bucket = &buckets[p][t];
+
+			if (!bucket->peak)
+				continue;
+
+			fprintf(f, "  %-8s tiling %-4s: %llu KiB in %u bo's, peak %llu KiB\n",
+					purpose_names[p], tiling_names[t],
+					(unsigned long long)bucket->bytes / 1024, bucket->count,
+					(unsigned long long)bucket->peak / 1024);
+		}
+	}
+}
+
+static void
+report_json(FILE *f)
+{
+	const char *sep = "";
+	int p, t;
+
+	fprintf(f, "{\"bytes\": %llu, \"count\": %u, \"peak\": %llu, \"buckets\": [",
+			(unsigned long long)total.bytes, total.count,
+			(unsigned long long)total.peak);
+
+	for (p = 0; p < MEM_PURPOSE_CNT; p++) {
+		for (t = 0; t < TILING_CNT; t++) {
+			struct mem_bucket *bucket = &buckets[p][t];
+
+			if (!bucket->peak)
+				continue;
+
+			fprintf(f, "%s{\"purpose\": \"%s\", \"tiling\": \"%s\", "
+					"\"bytes\": %llu, \"count\": %u, \"peak\": %llu}",
+					sep, purpose_names[p], tiling_names[t],
+					(unsigned long long)bucket->bytes, bucket->count,
+					(unsigned long long)bucket->peak);
+			sep = ", ";
+		}
+	}
+
+	fprintf(f, "]}\n");
+}
+
+void
+mem_report(FILE *f)
+{
+	pthread_mutex_lock(&lock);
+	if (json)
+		report_json(f);
+	else
+		report_text(f);
+	pthread_mutex_unlock(&lock);
+	fflush(f);
+}
+
+/* printing from the signal handler is not safe, so the report is printed
+ * on the next mem_poll_report():
+ */
+static void
+sigusr1_handler(int sig)
+{
+	report_requested = 1;
+}
+
+void
+mem_poll_report(void)
+{
+	if (report_requested) {
+		report_requested = 0;
+		mem_report(stderr);
+	}
+}
+
+static void
+report_at_exit(void)
+{
+	mem_report(stderr);
+}
+
+int
+mem_enable_report(const char *format)
+{
+	static bool enabled;
+	struct sigaction sa = {
+			.sa_handler = sigusr1_handler,
+	};
+
+	if (!strcmp(format, "json")) {
+		json = true;
+	} else if (!strcmp(format, "text")) {
+		json = false;
+	} else {
+		return -1;
+	}
+
+	if (enabled)
+		return 0;
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL))
+		return -1;
+	if (atexit(report_at_exit))
+		return -1;
+
+	enabled = true;
+
+	return 0;
+}
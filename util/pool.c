@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/* Bounded multi-producer/multi-consumer FIFO of buffers, so that threads
+ * (demux, decode, capture, display) can hand buffers to each other.
+ *
+ * This is the usual array based queue where each cell carries a sequence
+ * number: a cell at position pos is free for the producer when its seq is
+ * pos, and holds a buffer for the consumer when its seq is pos+1.  The
+ * producer and consumer only contend on their own position counter (with
+ * a compare-and-swap), and never take a lock.
+ *
+ * The mutex/condvar are only for the blocking pool_get_timeout(), and are
+ * only touched by pool_put() when someone is actually waiting.
+ */
+
+#define CACHELINE 64
+
+struct pool_cell {
+	uint32_t seq;
+	struct buffer *buf;
+};
+
+struct pool {
+	uint32_t mask;
+	struct pool_cell *cells;
+
+	/* keep the producer and consumer positions on separate cachelines: */
+	uint32_t head __attribute__((aligned(CACHELINE)));
+	uint32_t tail __attribute__((aligned(CACHELINE)));
+
+	int waiters __attribute__((aligned(CACHELINE)));
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct pool *
+pool_new(uint32_t size)
+{
+	struct pool *pool;
+	pthread_condattr_t attr;
+	uint32_t i, n = 1;
+
+	while (n < size)
+		n <<= 1;
+
+	if (posix_memalign((void **)&pool, CACHELINE, sizeof(*pool))) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+
+	pool->cells = calloc(n, sizeof(*pool->cells));
+	if (!pool->cells) {
+		ERROR("allocation failed");
+		free(pool);
+		return NULL;
+	}
+
+	pool->mask = n - 1;
+	for (i = 0; i < n; i++)
+		pool->cells[i].seq = i;
+
+	/* timed waits are against the monotonic clock, which clock steps
+	 * don't move:
+	 */
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return pool;
+}
+
+void
+pool_free(struct pool *pool)
+{
+	if (!pool)
+		return;
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->cells);
+	free(pool);
+}
+
+static bool
+enqueue(struct pool *pool, struct buffer *buf)
+{
+	uint32_t pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+	struct pool_cell *cell;
+
+	while (true) {
+		int32_t diff;
+
+		cell = &pool->cells[pos & pool->mask];
+		diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+		if (diff == 0) {
+			/* on failure, pos is updated to the current head: */
+			if (__atomic_compare_exchange_n(&pool->head, &pos, pos + 1,
+					true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;	/* full */
+		} else {
+			pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->buf = buf;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static struct buffer *
+dequeue(struct pool *pool)
+{
+	uint32_t pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+	struct pool_cell *cell;
+	struct buffer *buf;
+
+	while (true) {
+		int32_t diff;
+
+		cell = &pool->cells[pos & pool->mask];
+		diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&pool->tail, &pos, pos + 1,
+					true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;	/* empty */
+		} else {
+			pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	buf = cell->buf;
+	/* free the cell for the producer one lap later: */
+	__atomic_store_n(&cell->seq, pos + pool->mask + 1, __ATOMIC_RELEASE);
+
+	return buf;
+}
+
+bool
+pool_put(struct pool *pool, struct buffer *buf)
+{
+	if (!enqueue(pool, buf))
+		return false;
+
+	/* pairs with the increment of waiters in pool_get_timeout(), either
+	 * we see the waiter, or it sees the buffer:
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->waiters, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return true;
+}
+
+struct buffer *
+pool_get(struct pool *pool)
+{
+	return dequeue(pool);
+}
+
+struct buffer *
+pool_get_timeout(struct pool *pool, int timeout_ms)
+{
+	struct buffer *buf;
+	struct timespec ts;
+
+	buf = dequeue(pool);
+	if (buf || !timeout_ms)
+		return buf;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while (!(buf = dequeue(pool))) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		} else if (pthread_cond_timedwait(&pool->cond, &pool->lock, &ts)) {
+			buf = dequeue(pool);
+			break;
+		}
+	}
+
+	__atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->lock);
+
+	return buf;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <signal.h>
+#include <sys/syscall.h>
+
+/* Events are recorded in a ring, so a long run keeps the last NEVENTS of
+ * them, and written out as Chrome trace-event json, which Perfetto and
+ * chrome://tracing open.
+ */
+#define NEVENTS (1 << 16)
+
+struct trace_event {
+	uint64_t ts;
+	const char *name;
+	const void *id;
+	int64_t value;
+	uint32_t tid;
+	char ph;
+};
+
+bool trace_enabled;
+
+static struct trace_event *events;
+static uint32_t head;
+static const char *trace_path;
+static volatile sig_atomic_t dump_requested;
+
+static uint32_t
+gettid_cached(void)
+{
+	static __thread uint32_t tid;
+
+	if (!tid)
+		tid = syscall(SYS_gettid);
+
+	return tid;
+}
+
+void
+trace_event(char ph, const char *name, const void *id, int64_t value)
+{
+	uint32_t idx = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	struct trace_event *ev = &events[idx % NEVENTS];
+
+	ev->ts = time_ns();
+	ev->name = name;
+	ev->id = id;
+	ev->value = value;
+	ev->tid = gettid_cached();
+	ev->ph = ph;
+}
+
+/* Recording is not stopped while dumping, so the oldest few events may be
+ * overwritten while they are written out.  That is fine for a trace.
+ */
+void
+trace_dump(void)
+{
+	uint32_t i, start, end = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	const char *sep = "";
+	int pid = getpid();
+	FILE *f;
+
+	if (!trace_enabled)
+		return;
+
+	f = fopen(trace_path, "w");
+	if (!f) {
+		ERROR("could not open %s: %s", trace_path, strerror(errno));
+		return;
+	}
+
+	start = (end > NEVENTS) ? end - NEVENTS : 0;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	for (i = start; i != end; i++) {
+		struct trace_event *ev = &events[i % NEVENTS];
+
+		fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %llu.%03llu, "
+				"\"pid\": %d, \"tid\": %u", sep, ev->name, ev->ph,
+				(unsigned long long)ev->ts / 1000,
+				(unsigned long long)ev->ts % 1000, pid, ev->tid);
+
+		switch (ev->ph) {
+		case 'C':
+			fprintf(f, ", \"args\": {\"value\": %lld}", (long long)ev->value);
+			break;
+		case 'b':
+		case 'e':
+			/* async events are matched up by category and id: */
+			fprintf(f, ", \"cat\": \"buffer\", \"id\": \"%p\"", ev->id);
+			break;
+		case 'i':
+			fprintf(f, ", \"s\": \"t\"");
+			/* fallthrough */
+		default:
+			if (ev->id)
+				fprintf(f, ", \"args\": {\"id\": \"%p\"}", ev->id);
+			break;
+		}
+
+		fprintf(f, "}");
+		sep = ",\n";
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	MSG("wrote %u trace events to %s", end - start, trace_path);
+}
+
+/* writing the file from the signal handler is not safe, so it is done on
+ * the next trace_poll_dump():
+ */
+static void
+sigusr2_handler(int sig)
+{
+	dump_requested = 1;
+}
+
+void
+trace_poll_dump(void)
+{
+	if (dump_requested) {
+		dump_requested = 0;
+		trace_dump();
+	}
+}
+
+int
+trace_enable(const char *path)
+{
+	struct sigaction sa = {
+			.sa_handler = sigusr2_handler,
+	};
+
+	if (trace_enabled)
+		return 0;
+
+	events = calloc(NEVENTS, sizeof(*events));
+	if (!events) {
+		ERROR("allocation failed");
+		return -1;
+	}
+
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR2, &sa, NULL))
+		return -1;
+	if (atexit(trace_dump))
+		return -1;
+
+	trace_path = path;
+	trace_enabled = true;
+
+	return 0;
+}
@@ -22,6 +22,7 @@
 #include "util.h"
 
 #include <drm.h>
+#include <poll.h>
 
 /* Dynamic debug. */
 int debug = 0;
@@ -29,6 +30,9 @@ int debug = 0;
 void disp_kms_usage(void);
 struct display * disp_kms_open(int argc, char **argv);
 
+void disp_file_usage(void);
+struct display * disp_file_open(int argc, char **argv);
+
 #ifdef HAVE_X11
 void disp_x11_usage(void);
 struct display * disp_x11_open(int argc, char **argv);
@@ -44,8 +48,15 @@ disp_usage(void)
 {
 	MSG("Generic Display options:");
 	MSG("\t--debug\tTurn on debug messages.");
-	MSG("\t--fps <fps>\tforce playback rate (0 means \"do not force\")");
+	MSG("\t--fps <fps>\tforce playback rate, as <n> or <num>/<den> (0 means \"do not force\")");
+	MSG("\t--vsync\tschedule each frame for a vblank, if the display supports it");
 	MSG("\t--no-post\tDo not post buffers (disables screen updates) for benchmarking. Rate can still be controlled.");
+	MSG("\t--fill-threads <n>\tsplit test pattern fills across n threads (0 means one per cpu, default 1)");
+	MSG("\t--fill-template\tgenerate test patterns by scrolling a cached template");
+	MSG("\t--colorspace <cs>\tYUV colorspace: bt601 (default), bt709, bt601-full or bt709-full");
+	MSG("\t--mem-report <fmt>\treport bo memory use on exit and SIGUSR1, as text or json");
+	MSG("\t--latency\treport per-stage latency percentiles on exit");
+	MSG("\t--trace <file>\twrite a trace of the frame pipeline (trace-event json) on exit and SIGUSR2");
 
 #ifdef HAVE_X11
 	disp_x11_usage();
@@ -54,6 +65,7 @@ disp_usage(void)
 	disp_kmscube_usage();
 #endif
 	disp_kms_usage();
+	disp_file_usage();
 }
 
 static int
@@ -72,8 +84,10 @@ empty_post_vid_buffer(struct display *disp, struct buffer *buf,
 struct display *
 disp_open(int argc, char **argv)
 {
-	struct display *disp;
-	int i, fps = 0, no_post = 0;
+	struct display *disp, *out;
+	enum color_space colorspace = COLOR_BT601;
+	uint32_t fps_num = 0, fps_den = 1;
+	int i, no_post = 0, vsync = 0;
 
 	for (i = 1; i < argc; i++) {
 		if (!argv[i]) {
@@ -87,12 +101,78 @@ disp_open(int argc, char **argv)
 		} else if (!strcmp("--fps", argv[i])) {
 			argv[i++] = NULL;
 
-			if (sscanf(argv[i], "%d", &fps) != 1) {
+			if ((sscanf(argv[i], "%u/%u", &fps_num, &fps_den) < 1) ||
+					!fps_den) {
 				ERROR("invalid arg: %s", argv[i]);
 				return NULL;
 			}
 
-			MSG("Forcing playback rate at %d fps.", fps);
+			MSG("Forcing playback rate at %.3f fps.",
+					(double)fps_num / fps_den);
+			argv[i] = NULL;
+
+		} else if (!strcmp("--fill-threads", argv[i])) {
+			int n;
+			argv[i++] = NULL;
+
+			if (sscanf(argv[i], "%d", &n) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				return NULL;
+			}
+
+			if (fill_set_threads(n)) {
+				ERROR("could not start fill threads");
+				return NULL;
+			}
+
+			MSG("Using %d fill threads.", fill_get_threads());
+			argv[i] = NULL;
+
+		} else if (!strcmp("--fill-template", argv[i])) {
+			MSG("Using cached test pattern templates.");
+			fill_set_template(true);
+			argv[i] = NULL;
+
+		} else if (!strcmp("--colorspace", argv[i])) {
+			argv[i++] = NULL;
+
+			if (color_parse(argv[i], &colorspace)) {
+				ERROR("invalid arg: %s", argv[i]);
+				return NULL;
+			}
+
+			MSG("Using %s colorspace.", argv[i]);
+			argv[i] = NULL;
+
+		} else if (!strcmp("--mem-report", argv[i])) {
+			argv[i++] = NULL;
+
+			if (mem_enable_report(argv[i])) {
+				ERROR("invalid arg: %s", argv[i]);
+				return NULL;
+			}
+
+			argv[i] = NULL;
+
+		} else if (!strcmp("--latency", argv[i])) {
+			if (hist_enable_report()) {
+				ERROR("could not enable latency report");
+				return NULL;
+			}
+			argv[i] = NULL;
+
+		} else if (!strcmp("--trace", argv[i])) {
+			argv[i++] = NULL;
+
+			if (trace_enable(argv[i])) {
+				ERROR("could not enable tracing");
+				return NULL;
+			}
+
+			argv[i] = NULL;
+
+		} else if (!strcmp("--vsync", argv[i])) {
+			vsync = 1;
 			argv[i] = NULL;
 
 		} else if (!strcmp("--no-post", argv[i])) {
@@ -102,6 +182,10 @@ disp_open(int argc, char **argv)
 		}
 	}
 
+	disp = disp_file_open(argc, argv);
+	if (disp)
+		goto out;
+
 #ifdef HAVE_X11
 	disp = disp_x11_open(argc, argv);
 	if (disp)
@@ -117,103 +201,449 @@ disp_open(int argc, char **argv)
 
 	if (!disp) {
 		ERROR("unable to create display");
+		return NULL;
 	}
 
 out:
-	disp->rtctl.fps = fps;
-
-	/* If buffer posting is disabled from command line, override post
-	 * functions with empty ones. */
-	if (no_post) {
-		disp->post_buffer = empty_post_buffer;
-		disp->post_vid_buffer = empty_post_vid_buffer;
+	for (out = disp; out; out = out->next_output) {
+		out->rtctl.fps_num = fps_num;
+		out->rtctl.fps_den = fps_den;
+
+		if (vsync && !out->wait_vblank) {
+			MSG("Display does not support vsync, using timers.");
+		} else if (vsync) {
+			MSG("Scheduling frames for vblanks, refresh rate %.3f Hz.",
+					(double)out->refresh_num / out->refresh_den);
+			out->rtctl.vsync = true;
+		}
+		out->colorspace = colorspace;
+
+		/* If buffer posting is disabled from command line, override post
+		 * functions with empty ones. */
+		if (no_post) {
+			out->post_buffer = empty_post_buffer;
+			out->post_vid_buffer = empty_post_vid_buffer;
+			out->dispatch = NULL;
+		}
 	}
 
 	return disp;
 }
 
+void
+disp_close(struct display *disp)
+{
+	struct rate_control *p = &disp->rtctl;
+
+	if (disp->next_output)
+		disp_close(disp->next_output);
+	disp->next_output = NULL;
+
+	if (p->vsync)
+		MSG("vsync: %u vblanks missed, %u resyncs", p->missed, p->resyncs);
+
+	/* the pools of the sets of video buffers the app did not free: */
+	while (disp->npools)
+		pool_free(disp->pools[--disp->npools]);
+	free(disp->pools);
+	disp->pools = NULL;
+	disp->unlocked = NULL;
+	disp->scanout = NULL;
+
+	disp->close(disp);
+}
+
 struct buffer **
 disp_get_vid_buffers(struct display *disp, uint32_t n,
 		uint32_t fourcc, uint32_t w, uint32_t h)
 {
 	struct buffer **buffers;
+	struct pool *pool, **pools;
 	unsigned int i;
 
 	buffers = disp->get_vid_buffers(disp, n, fourcc, w, h);
 	if (buffers) {
 		/* if allocation succeeded, store in the unlocked
-		 * video buffer list
+		 * video buffer pool.  Buffers from an earlier call keep
+		 * going back to their own pool, which is freed along with
+		 * them in disp_free_buffers().
 		 */
-		list_init(&disp->unlocked);
-		for (i = 0; i < n; i++)
-			list_add(&buffers[i]->unlocked, &disp->unlocked);
+		pool = pool_new(n);
+		pools = realloc(disp->pools,
+				(disp->npools + 1) * sizeof(*disp->pools));
+		if (pools)
+			disp->pools = pools;
+		if (!pool || !pools) {
+			ERROR("allocation failed");
+			pool_free(pool);
+			if (disp->free_buffers)
+				disp->free_buffers(disp, buffers, n);
+			else
+				free(buffers);
+			return NULL;
+		}
+		disp->pools[disp->npools++] = pool;
+		disp->unlocked = pool;
+		for (i = 0; i < n; i++) {
+			buffers[i]->colorspace = disp->colorspace;
+			/* the backend may have recycled a freed buffer: */
+			buffers[i]->refcnt = 0;
+			buffers[i]->checked_out = false;
+			buffers[i]->pool = pool;
+			pool_put(pool, buffers[i]);
+		}
 	}
 
 	return buffers;
 }
 
-struct buffer *
-disp_get_vid_buffer(struct display *disp)
+void
+disp_free_buffers(struct display *disp, struct buffer **bufs, uint32_t n)
 {
-	struct buffer *buf = NULL;
-	if (!list_is_empty(&disp->unlocked)) {
-		buf = list_last_entry(&disp->unlocked, struct buffer, unlocked);
-		list_del(&buf->unlocked);
+	struct pool *pool;
+	uint32_t i;
+
+	if (!bufs)
+		return;
+
+	/* the pool only holds buffers of this set, current or not: */
+	pool = n ? bufs[0]->pool : NULL;
+	if (pool) {
+		if (pool == disp->unlocked)
+			disp->unlocked = NULL;
+		for (i = 0; i < disp->npools; i++) {
+			if (disp->pools[i] == pool) {
+				disp->pools[i] = disp->pools[--disp->npools];
+				break;
+			}
+		}
+		pool_free(pool);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (disp->scanout == bufs[i])
+			disp->scanout = NULL;
+		bufs[i]->pool = NULL;
+	}
+
+	if (disp->free_buffers)
+		disp->free_buffers(disp, bufs, n);
+	else
+		free(bufs);
+}
+
+bool
+disp_supports_format(struct display *disp, uint32_t fourcc)
+{
+	if (!disp->supports_format)
+		return true;
+	return disp->supports_format(disp, fourcc);
+}
+
+/* Wait until the display (or GPU) is done reading a posted buffer.  Polling
+ * a dmabuf for POLLOUT waits for all the fences (read and write) attached
+ * to it, which is what we need before writing to the buffer again.
+ */
+static void
+wait_idle(struct display *disp, struct buffer *buf)
+{
+	struct pollfd pfd[4];
+	/* buffers without bo's have the dmabufs their backend exported: */
+	int nplanes = buf->nbo ? buf->nbo : buf->ndmabuf;
+	int i, n = 0;
+
+	if (!buf->fenced)
+		return;
+
+	TRACE_BEGIN("wait idle", buf);
 
+	if (disp->wait_release && disp->wait_release(disp, buf))
+		goto out;
+
+	if (!disp->cpu_sync) {
+		for (i = 0; i < nplanes; i++) {
+			if (i == buf->ndmabuf) {
+				int fd = omap_bo_dmabuf(buf->bo[i]);
+				if (fd < 0)
+					break;
+				buf->dmabuf[buf->ndmabuf++] = fd;
+			}
+			pfd[n].fd = buf->dmabuf[i];
+			pfd[n].events = POLLOUT;
+			n++;
+		}
+	}
+
+	if (n == nplanes) {
+		/* poll() returns once any fd is ready, so wait on the
+		 * planes one at a time:
+		 */
+		for (i = 0; i < n; i++) {
+			while (poll(&pfd[i], 1, -1) < 0) {
+				if (errno != EINTR && errno != EAGAIN) {
+					ERROR("poll failed: %s", strerror(errno));
+					break;
+				}
+			}
+		}
+	} else {
 		/* barrier.. if we are using GPU blitting, we need to make sure
 		 * that the GPU is finished:
 		 */
-		omap_bo_cpu_prep(buf->bo[0], OMAP_GEM_WRITE);
-		omap_bo_cpu_fini(buf->bo[0], OMAP_GEM_WRITE);
+		for (i = 0; i < buf->nbo; i++) {
+			omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_WRITE);
+			omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_WRITE);
+		}
+	}
+
+out:
+	buf->fenced = false;
+
+	TRACE_END("wait idle", buf);
+}
+
+struct buffer *
+disp_wait_vid_buffer(struct display *disp, int timeout_ms)
+{
+	struct buffer *buf = NULL;
+
+	/* the pool is a FIFO, so this is the buffer released the longest time
+	 * ago, and the most likely to already be idle:
+	 */
+	if (disp->unlocked)
+		buf = pool_get_timeout(disp->unlocked, timeout_ms);
+
+	if (buf) {
+		TRACE_ASYNC_BEGIN("checked out", buf);
+		wait_idle(disp, buf);
+		buf->checked_out = true;
+		__atomic_store_n(&buf->refcnt, 1, __ATOMIC_RELAXED);
 	}
+
 	return buf;
 }
 
+struct buffer *
+disp_get_vid_buffer(struct display *disp)
+{
+	return disp_wait_vid_buffer(disp, 0);
+}
+
+void
+disp_ref_vid_buffer(struct buffer *buf)
+{
+	__atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
 void
 disp_put_vid_buffer(struct display *disp, struct buffer *buf)
 {
-	list_add(&buf->unlocked, &disp->unlocked);
+	int refcnt = __atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL);
+
+	if (refcnt < 0) {
+		ERROR("unbalanced put of buffer %p", buf);
+		__atomic_store_n(&buf->refcnt, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* buffers which were never taken out of the pool (ie. shared with
+	 * v4l2 directly) have nowhere to go back to:
+	 */
+	if (refcnt || !buf->checked_out || !buf->pool)
+		return;
+
+	buf->checked_out = false;
+	TRACE_ASYNC_END("checked out", buf);
+	if (!pool_put(buf->pool, buf))
+		ERROR("video buffer pool is full");
+}
+
+/* time of frame n after the start, split so that it can't overflow: */
+static uint64_t
+frame_time(struct rate_control *p, uint64_t n)
+{
+	uint64_t secs = n / p->fps_num, rem = n % p->fps_num;
+
+	return p->start + (secs * p->fps_den * NSEC_PER_SEC) +
+			(rem * p->fps_den * NSEC_PER_SEC / p->fps_num);
+}
+
+/* Wait until the frame can be posted to be presented at its vblank.  The
+ * post lands on the vblank after it is queued, so that is one earlier.
+ */
+static void
+schedule_vblank(struct display *disp, struct rate_control *p)
+{
+	double ratio = 1.0;	/* vblanks per frame */
+	uint32_t cur, target;
+	uint64_t ns;
+
+	if (disp->wait_vblank(disp, 0, true, &cur, &ns))
+		return;
+
+	if (p->fps_num)
+		ratio = ((double)disp->refresh_num * p->fps_den) /
+				((double)disp->refresh_den * p->fps_num);
+
+	if (!p->frames)
+		p->vbl_start = cur + 1;
+
+	target = p->vbl_start + (uint32_t)(p->frames * ratio + 0.5);
+
+	if ((int32_t)(cur - (target - 1)) > 0) {
+		/* too late for the target, present at the next vblank and
+		 * keep the cadence from there:
+		 */
+		DBG("missed vblank %u by %u", target, cur + 1 - target);
+		p->missed += cur + 1 - target;
+		TRACE_COUNTER("missed vblanks", p->missed);
+		p->resyncs++;
+		p->vbl_start = target = cur + 1;
+		p->frames = 0;
+	} else if (cur != target - 1) {
+		DBG("waiting for vblank %u, at %u", target - 1, cur);
+		disp->wait_vblank(disp, target - 1, false, &cur, &ns);
+	}
+
+	if (p->frames)
+		DBG("fps: %.02f", (double)NSEC_PER_SEC / (ns - p->last));
+
+	p->vbl_target = target;
+	p->frames++;
+	p->last = ns;
+}
+
+void
+disp_check_flip(struct display *disp, uint32_t target, uint32_t seq)
+{
+	struct rate_control *p = &disp->rtctl;
+
+	if (!p->vsync || !target)
+		return;
+
+	if ((int32_t)(seq - target) > 0) {
+		DBG("flip for vblank %u landed on %u", target, seq);
+		p->missed += seq - target;
+		TRACE_COUNTER("missed vblanks", p->missed);
+	}
 }
 
 /* Maintain playback rate if fps > 0. */
 static void maintain_playback_rate(struct rate_control *p)
 {
-	long usecs_since_last_frame;
-	int usecs_between_frames, usecs_to_sleep;
+	uint64_t now, deadline, period;
+	struct timespec ts;
 
-	if (p->fps <= 0)
+	if (!p->fps_num)
 		return;
 
-	usecs_between_frames = 1000000 / p->fps;
-	usecs_since_last_frame = mark(&p->last_frame_mark);
-	DBG("fps: %.02f", 1000000.0 / usecs_since_last_frame);
-	usecs_to_sleep = usecs_between_frames - usecs_since_last_frame + p->usecs_to_sleep;
+	now = time_ns();
+	period = p->fps_den * NSEC_PER_SEC / p->fps_num;
 
-	if (usecs_to_sleep < 0)
-		usecs_to_sleep = 0;
+	if (p->frames) {
+		deadline = frame_time(p, p->frames);
 
-	/* mark() has a limitation that >1s time deltas will make the whole
-	 * loop diverge. Workaround that limitation by clamping our desired sleep time
-	 * to a maximum. TODO: Remove when mark() is in better shape. */
-	if (usecs_to_sleep >= 1000000)
-		usecs_to_sleep = 999999;
+		/* more than a frame late (or the first frame in a while),
+		 * start over from now rather than rushing to catch up:
+		 */
+		if (now > deadline + period)
+			p->frames = 0;
+	}
 
-	/* We filter a bit our rate adaptation, to avoid being too "choppy".
-	 * Adjust the "alpha" value as needed. */
-	p->usecs_to_sleep = ((67 * p->usecs_to_sleep) + (33 * usecs_to_sleep)) / 100;
+	if (!p->frames) {
+		p->start = now;
+		deadline = now;
+	}
 
-	if (p->usecs_to_sleep >= 1) {
-		DBG("sleeping %dus", p->usecs_to_sleep);
-		usleep(p->usecs_to_sleep);
+	if (deadline > now) {
+		DBG("sleeping %lluus", (unsigned long long)(deadline - now) / 1000);
+		ts.tv_sec = deadline / NSEC_PER_SEC;
+		ts.tv_nsec = deadline % NSEC_PER_SEC;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			continue;
 	}
+
+	/* the frame period is from one post to the next: */
+	now = time_ns();
+	if (p->last)
+		DBG("fps: %.02f", (double)NSEC_PER_SEC / (now - p->last));
+
+	p->frames++;
+	p->last = now;
+}
+
+/* nonblocking apps pace the frames themselves: */
+static void
+pace(struct display *disp)
+{
+	if (disp->nonblock)
+		return;
+
+	TRACE_BEGIN("pace", NULL);
+	if (disp->rtctl.vsync)
+		schedule_vblank(disp, &disp->rtctl);
+	else
+		maintain_playback_rate(&disp->rtctl);
+	TRACE_END("pace", NULL);
 }
 
 /* flip to / post the specified buffer */
 int
 disp_post_buffer(struct display *disp, struct buffer *buf)
 {
-	maintain_playback_rate(&disp->rtctl);
-	return disp->post_buffer(disp, buf);
+	int ret;
+
+	mem_poll_report();
+	trace_poll_dump();
+
+	pace(disp);
+	buf->fenced = true;
+
+	TRACE_BEGIN("post buffer", buf);
+	ret = disp->post_buffer(disp, buf);
+	TRACE_END("post buffer", buf);
+
+	/* synchronous backends are done with the previous buffer: */
+	if (!ret && !disp->dispatch) {
+		if (disp->posted && (disp->posted != buf))
+			disp_release_buffer(disp, disp->posted);
+		disp->posted = buf;
+	}
+
+	return ret;
+}
+
+void
+disp_set_release(struct display *disp,
+		void (*release)(struct display *disp, struct buffer *buf, void *data),
+		void *data)
+{
+	disp->release = release;
+	disp->release_data = data;
+}
+
+int
+disp_dispatch(struct display *disp, int timeout_ms)
+{
+	if (!disp->dispatch)
+		return 0;
+	return disp->dispatch(disp, timeout_ms);
+}
+
+int
+disp_get_fd(struct display *disp)
+{
+	/* the backends with events get them on the drm fd: */
+	return disp->dispatch ? disp->fd : -1;
+}
+
+int
+disp_set_nonblock(struct display *disp, bool nonblock)
+{
+	if (nonblock && !disp->dispatch)
+		return -1;
+	disp->nonblock = nonblock;
+	return 0;
 }
 
 /* flip to / post the specified video buffer */
@@ -221,8 +651,37 @@ int
 disp_post_vid_buffer(struct display *disp, struct buffer *buf,
 		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
-	maintain_playback_rate(&disp->rtctl);
-	return disp->post_vid_buffer(disp, buf, x, y, w, h);
+	struct buffer *old = disp->scanout;
+	int ret;
+
+	mem_poll_report();
+	trace_poll_dump();
+
+	pace(disp);
+
+	/* the display holds on to the buffer while it is on screen: */
+	disp_ref_vid_buffer(buf);
+	buf->fenced = true;
+
+	TRACE_BEGIN("post vid buffer", buf);
+	ret = disp->post_vid_buffer(disp, buf, x, y, w, h);
+	TRACE_END("post vid buffer", buf);
+	if (ret) {
+		disp_put_vid_buffer(disp, buf);
+		return ret;
+	}
+
+	/* synchronous backends are done with the previous buffer, the
+	 * others release it once it is off screen:
+	 */
+	if (!disp->dispatch && old && (old != buf))
+		disp_release_buffer(disp, old);
+
+	disp->scanout = buf;
+	if (old)
+		disp_put_vid_buffer(disp, old);
+
+	return 0;
 }
 
 struct buffer *
@@ -249,127 +708,3 @@ check_args(int argc, char **argv)
 	}
 	return 0;
 }
-
-/* stolen from modetest.c */
-static void
-fillRGB4(char *virtual, int n, int width, int height, int stride)
-{
-	int i, j;
-	/* paint the buffer with colored tiles */
-	for (j = 0; j < height; j++) {
-		uint32_t *fb_ptr = (uint32_t*)((char*)virtual + j * stride);
-		for (i = 0; i < width; i++) {
-			div_t d = div(n+i+j, width);
-			fb_ptr[i] =
-					0x00130502 * (d.quot >> 6) +
-					0x000a1120 * (d.rem >> 6);
-		}
-	}
-}
-
-
-/* swap these for big endian.. */
-#define RED   2
-#define GREEN 1
-#define BLUE  0
-
-static void
-fill420(unsigned char *y, unsigned char *u, unsigned char *v,
-		int cs /*chroma pixel stride */,
-		int n, int width, int height, int stride)
-{
-	int i, j;
-
-	/* paint the buffer with colored tiles, in blocks of 2x2 */
-	for (j = 0; j < height; j+=2) {
-		unsigned char *y1p = y + j * stride;
-		unsigned char *y2p = y1p + stride;
-		unsigned char *up = u + (j/2) * stride * cs / 2;
-		unsigned char *vp = v + (j/2) * stride * cs / 2;
-
-		for (i = 0; i < width; i+=2) {
-			div_t d = div(n+i+j, width);
-			uint32_t rgb = 0x00130502 * (d.quot >> 6) + 0x000a1120 * (d.rem >> 6);
-			unsigned char *rgbp = (unsigned char *)&rgb;
-			unsigned char y = (0.299 * rgbp[RED]) + (0.587 * rgbp[GREEN]) + (0.114 * rgbp[BLUE]);
-
-			*(y2p++) = *(y1p++) = y;
-			*(y2p++) = *(y1p++) = y;
-
-			*up = (rgbp[BLUE] - y) * 0.565 + 128;
-			*vp = (rgbp[RED] - y) * 0.713 + 128;
-			up += cs;
-			vp += cs;
-		}
-	}
-}
-
-static void
-fill422(unsigned char *virtual, int n, int width, int height, int stride)
-{
-	int i, j;
-	/* paint the buffer with colored tiles */
-	for (j = 0; j < height; j++) {
-		uint8_t *ptr = (uint8_t*)((char*)virtual + j * stride);
-		for (i = 0; i < width; i++) {
-			div_t d = div(n+i+j, width);
-			uint32_t rgb = 0x00130502 * (d.quot >> 6) + 0x000a1120 * (d.rem >> 6);
-			unsigned char *rgbp = (unsigned char *)&rgb;
-			unsigned char y = (0.299 * rgbp[RED]) + (0.587 * rgbp[GREEN]) + (0.114 * rgbp[BLUE]);
-
-			*(ptr++) = y;
-			*(ptr++) = (rgbp[BLUE] - y) * 0.565 + 128;
-			*(ptr++) = y;
-			*(ptr++) = (rgbp[RED] - y) * 0.713 + 128;
-		}
-	}
-}
-
-
-void
-fill(struct buffer *buf, int n)
-{
-	int i;
-
-	for (i = 0; i < buf->nbo; i++)
-		omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_WRITE);
-
-	switch(buf->fourcc) {
-	case 0: {
-		assert(buf->nbo == 1);
-		fillRGB4(omap_bo_map(buf->bo[0]), n,
-				buf->width, buf->height, buf->pitches[0]);
-		break;
-	}
-	case FOURCC('Y','U','Y','V'): {
-		assert(buf->nbo == 1);
-		fill422(omap_bo_map(buf->bo[0]), n,
-				buf->width, buf->height, buf->pitches[0]);
-		break;
-	}
-	case FOURCC('N','V','1','2'): {
-		unsigned char *y, *u, *v;
-		assert(buf->nbo == 2);
-		y = omap_bo_map(buf->bo[0]);
-		u = omap_bo_map(buf->bo[1]);
-		v = u + 1;
-		fill420(y, u, v, 2, n, buf->width, buf->height, buf->pitches[0]);
-		break;
-	}
-	case FOURCC('I','4','2','0'): {
-		unsigned char *y, *u, *v;
-		assert(buf->nbo == 3);
-		y = omap_bo_map(buf->bo[0]);
-		u = omap_bo_map(buf->bo[1]);
-		v = omap_bo_map(buf->bo[2]);
-		fill420(y, u, v, 1, n, buf->width, buf->height, buf->pitches[0]);
-		break;
-	}
-	default:
-		ERROR("invalid format: 0x%08x", buf->fourcc);
-		break;
-	}
-
-	for (i = 0; i < buf->nbo; i++)
-		omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_WRITE);
-}
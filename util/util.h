@@ -39,6 +39,84 @@ typedef enum {
 
 #include "list.h"
 
+/* Color conversion:
+ *
+ * Fixed point RGB <-> YCbCr conversion for BT.601/BT.709, in limited
+ * (16..235) or full (0..255) range.
+ */
+
+#define COLOR_SHIFT 14
+#define COLOR_HALF  (1 << (COLOR_SHIFT - 1))
+
+enum color_space {
+	COLOR_BT601 = 0,	/* default, what video decoders/cameras output */
+	COLOR_BT709,
+	COLOR_BT601_FULL,
+	COLOR_BT709_FULL,
+};
+
+struct color_conv {
+	const char *name;
+	enum color_space cs;
+	/* rgb -> yuv, in COLOR_SHIFT fixed point: */
+	int32_t yr, yg, yb, ur, ug, ub, vr, vg, vb, yoff;
+	/* yuv -> rgb, in COLOR_SHIFT fixed point: */
+	int32_t ky, rv, gu, gv, bu;
+};
+
+const struct color_conv * color_get(enum color_space cs);
+
+/* Parse "bt601", "bt709", "bt601-full" or "bt709-full" */
+int color_parse(const char *str, enum color_space *cs);
+
+/* Convert n pixels between XRGB8888 and unsubsampled (4:4:4) Y/U/V rows */
+void color_xrgb_to_yuv_row(const struct color_conv *cc,
+		const uint32_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int n);
+void color_yuv_to_xrgb_row(const struct color_conv *cc,
+		const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		uint32_t *dst, int n);
+
+static inline void
+color_rgb2yuv(const struct color_conv *cc, uint32_t xrgb,
+		uint8_t *y, uint8_t *u, uint8_t *v)
+{
+	color_xrgb_to_yuv_row(cc, &xrgb, y, u, v, 1);
+}
+
+static inline bool
+color_is_bt709(enum color_space cs)
+{
+	return (cs == COLOR_BT709) || (cs == COLOR_BT709_FULL);
+}
+
+static inline bool
+color_is_full_range(enum color_space cs)
+{
+	return (cs == COLOR_BT601_FULL) || (cs == COLOR_BT709_FULL);
+}
+
+/* Buffer pool:
+ *
+ * Bounded, lock-free, FIFO of buffers which any number of threads can put
+ * buffers in and get buffers from.
+ */
+
+struct buffer;
+struct pool;
+
+/* size is rounded up to a power of two */
+struct pool * pool_new(uint32_t size);
+void pool_free(struct pool *pool);
+
+/* returns false if the pool is full */
+bool pool_put(struct pool *pool, struct buffer *buf);
+
+/* returns NULL if the pool is empty */
+struct buffer * pool_get(struct pool *pool);
+
+/* wait up to timeout_ms (forever if negative) for a buffer */
+struct buffer * pool_get_timeout(struct pool *pool, int timeout_ms);
+
 /* Display Interface:
  *
  * Could be either KMS or X11 depending on build and
@@ -53,23 +131,71 @@ struct buffer {
 	int nbo;
 	struct omap_bo *bo[4];
 	uint32_t pitches[4];
-	struct list unlocked;
+	uint32_t offsets[4];	/* of planes beyond nbo, within bo[0] */
 	bool multiplanar;	/* True when Y and U/V are in separate buffers. */
+	enum color_space colorspace;
+
+	/* Set when the buffer is posted, since the display (or GPU) may still
+	 * be reading it after it is released.  Cleared once the buffer's
+	 * fences have signaled, so idle buffers are reused without waiting.
+	 */
+	bool fenced;
+	int dmabuf[4];		/* exported on first wait */
+	int ndmabuf;
+
+	/* Video buffers can be held by several owners at once (the decoder
+	 * while it is locked as a reference frame, the display while it is
+	 * on screen, other consumers of the frame), and only go back to the
+	 * pool they came from once the last reference is dropped.
+	 */
+	int refcnt;
+	bool checked_out;	/* taken from the pool with disp_get_vid_buffer() */
+	struct pool *pool;
+
+	int64_t pts;		/* presentation time in ns, for apps which have one */
+
+	/* sync_file fd which the display waits on before scanning the buffer
+	 * out (and then closes), or -1.  Only the kms backend looks at it,
+	 * and it initializes it to -1.
+	 */
+	int acquire_fence;
+
+	/* for buffers in system memory rather than bo's (nbo is zero), all
+	 * the planes at their offsets in one mapping:
+	 */
+	void *map;
+	uint32_t size;
 };
 
-/* State variables, used to maintain the playback rate. */
+/* State variables, used to maintain the playback rate.  Frames are paced to
+ * absolute deadlines, computed from the frame count, so that the error of
+ * each sleep does not accumulate.
+ */
 struct rate_control {
-	int fps;		/* When > zero, we maintain playback rate. */
-	long last_frame_mark;	/* The time when the last frame was displayed,
-				 * as returned by the mark() function. */
-	int usecs_to_sleep;	/* Number of useconds we have slep last frame. */
+	uint32_t fps_num, fps_den;	/* When fps_num > zero, we maintain playback rate. */
+	uint64_t start;		/* time of the first frame since (re)sync, in ns */
+	uint64_t frames;	/* frames since then */
+	uint64_t last;		/* time of the last frame, in ns */
+
+	/* With vsync, each frame is instead scheduled for a vblank, counted
+	 * from the first one since (re)sync.  For a rate below the refresh
+	 * rate this gives a regular cadence, eg. 3:2 for 24 fps at 60 Hz.
+	 */
+	bool vsync;
+	uint32_t vbl_start;
+	uint32_t vbl_target;	/* vblank the last frame was scheduled for */
+	uint32_t missed;	/* vblanks that frames were late by, in total */
+	uint32_t resyncs;
 };
 
 struct display {
 	int fd;
 	uint32_t width, height;
 	struct omap_device *dev;
-	struct list unlocked;
+	struct pool *unlocked;	/* of buffers from disp_get_vid_buffers() */
+	struct pool **pools;	/* of every set of those not yet freed */
+	uint32_t npools;
+	struct buffer *scanout;	/* video buffer currently on screen */
 	struct rate_control rtctl;
 
 	struct buffer ** (*get_buffers)(struct display *disp, uint32_t n);
@@ -79,8 +205,57 @@ struct display {
 	int (*post_vid_buffer)(struct display *disp, struct buffer *buf,
 			uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 	void (*close)(struct display *disp);
+	/* optional, if NULL the buffers are leaked: */
+	void (*free_buffers)(struct display *disp, struct buffer **bufs,
+			uint32_t n);
+	/* optional, if NULL any format is assumed to be supported: */
+	bool (*supports_format)(struct display *disp, uint32_t fourcc);
+	/* optional, wait for vblank seq (or seq vblanks from now, if relative)
+	 * and return the current vblank count and its time in ns.  A relative
+	 * seq of 0 returns right away:
+	 */
+	int (*wait_vblank)(struct display *disp, uint32_t seq, bool relative,
+			uint32_t *cur, uint64_t *ns);
+	/* optional, for backends which post buffers asynchronously: handle
+	 * display events, waiting up to timeout_ms (forever if negative) for
+	 * some.  Returns 1 if events were handled, 0 on timeout:
+	 */
+	int (*dispatch)(struct display *disp, int timeout_ms);
+	/* optional, for backends with explicit fences: wait until the display
+	 * is done with a released buffer.  Returns false if there is no fence
+	 * for it, to fall back to implicit sync:
+	 */
+	bool (*wait_release)(struct display *disp, struct buffer *buf);
+
+	/* see disp_set_release() */
+	void (*release)(struct display *disp, struct buffer *buf, void *data);
+	void *release_data;
+	bool nonblock;		/* see disp_set_nonblock() */
+	struct buffer *posted;	/* last buffer posted, for backends w/o dispatch */
 
 	bool multiplanar;	/* True when Y and U/V are in separate buffers. */
+	enum color_space colorspace;	/* of YUV video buffers */
+
+	/* The GPU does not signal dma-buf fences, so wait for a released
+	 * buffer with omap_bo_cpu_prep() instead of polling the dmabuf:
+	 */
+	bool cpu_sync;
+
+	/* set by backends with wait_vblank(), the refresh rate in Hz is
+	 * refresh_num / refresh_den:
+	 */
+	uint32_t refresh_num, refresh_den;
+	/* set by backends with flip events, the vblank and time (in ns) at
+	 * which the last flip completed:
+	 */
+	uint32_t flip_seq;
+	uint64_t flip_ns;
+
+	/* When each connector is an output of its own (kms with --split), the
+	 * display of the next one.  Outputs have their own buffers, sized to
+	 * them, and flip independently.  They are closed with the first one.
+	 */
+	struct display *next_output;
 };
 
 /* Print display related help */
@@ -91,12 +266,11 @@ void disp_usage(void);
  */
 struct display * disp_open(int argc, char **argv);
 
-/* Close display */
-static inline void
-disp_close(struct display *disp)
-{
-	disp->close(disp);
-}
+/* Close display, freeing all of its buffers (whether or not they were
+ * given back with disp_free_buffers()), so none of them may be used after.
+ * The other outputs of the display are closed too.
+ */
+void disp_close(struct display *disp);
 
 /* Get normal RGB/UI buffers (ie. not scaled, not YUV) */
 static inline struct buffer **
@@ -109,18 +283,84 @@ disp_get_buffers(struct display *disp, uint32_t n)
 struct buffer ** disp_get_vid_buffers(struct display *disp, uint32_t n,
 		uint32_t fourcc, uint32_t w, uint32_t h);
 
-/* flip to / post the specified buffer */
+/* flip to / post the specified buffer.  Without a release callback, the
+ * buffer is on screen when this returns.  With one, the flip may still be
+ * in flight (or queued behind the one which is).
+ */
 int
 disp_post_buffer(struct display *disp, struct buffer *buf);
 
-/* flip to / post the specified video buffer */
+/* Set a callback for when a buffer posted with disp_post_buffer() or
+ * disp_post_vid_buffer() is off screen again (or was only copied from), and
+ * may be reused.  This makes posting asynchronous, on backends which support
+ * that.  The callback is called from the posts and disp_dispatch().
+ */
+void disp_set_release(struct display *disp,
+		void (*release)(struct display *disp, struct buffer *buf, void *data),
+		void *data);
+
+/* handle pending display events (ie. completed flips), waiting up to
+ * timeout_ms (forever if negative).  Returns 1 if events were handled, 0 if
+ * there were none, or -1 on error.
+ */
+int disp_dispatch(struct display *disp, int timeout_ms);
+
+/* For apps with an event loop of their own: the fd which is readable when
+ * disp_dispatch() has events to handle, or -1 if the display has none (and
+ * posts complete before they return).
+ */
+int disp_get_fd(struct display *disp);
+
+/* Make posts fail with -EAGAIN instead of waiting when the display can't
+ * take another buffer yet (ie. a flip is in flight), to be tried again
+ * after the next disp_dispatch().  Posts are not paced (--fps, --vsync)
+ * either, the app does that with its own timers.  The app has to use a
+ * release callback to know when its buffers are off screen.  Returns -1 if
+ * the display can't post without blocking.
+ */
+int disp_set_nonblock(struct display *disp, bool nonblock);
+
+/* for backends, to hand a buffer which is off screen back to the app: */
+static inline void
+disp_release_buffer(struct display *disp, struct buffer *buf)
+{
+	if (disp->release)
+		disp->release(disp, buf, disp->release_data);
+}
+
+/* for backends with flip events, to count the vblanks a flip queued for
+ * vblank target (the rtctl.vbl_target of its post) landed late by:
+ */
+void disp_check_flip(struct display *disp, uint32_t target, uint32_t seq);
+
+/* flip to / post the specified video buffer, the display holds a reference
+ * to it until the next video buffer is posted
+ */
 int
 disp_post_vid_buffer(struct display *disp, struct buffer *buf,
 		uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 
-/* allocate a buffer from pool created by disp_get_vid_buffers() */
+/* free buffers (and the array) from disp_get_buffers() or
+ * disp_get_vid_buffers(), which must no longer be used by anyone.  The
+ * backend may keep them around, to recycle for a later allocation.
+ */
+void disp_free_buffers(struct display *disp, struct buffer **bufs, uint32_t n);
+
+/* can video buffers of the specified format be scanned out? */
+bool disp_supports_format(struct display *disp, uint32_t fourcc);
+
+/* allocate a buffer from pool created by disp_get_vid_buffers(), the least
+ * recently released buffer is returned first.  The caller holds the only
+ * reference to the buffer.
+ */
 struct buffer * disp_get_vid_buffer(struct display *disp);
-/* free to video buffer pool */
+/* same, but wait up to timeout_ms (forever if negative) for a buffer */
+struct buffer * disp_wait_vid_buffer(struct display *disp, int timeout_ms);
+/* take an additional reference to a video buffer */
+void disp_ref_vid_buffer(struct buffer *buf);
+/* drop a reference, the buffer is freed to the video buffer pool once the
+ * last one is dropped
+ */
 void disp_put_vid_buffer(struct display *disp, struct buffer *buf);
 
 /* helper to setup the display for apps that just need video with
@@ -129,6 +369,130 @@ void disp_put_vid_buffer(struct display *disp, struct buffer *buf);
 struct buffer * disp_get_fb(struct display *disp);
 
 
+/* Format conversion:
+ *
+ * Converts video buffers, on a separate thread, into a pool of buffers of a
+ * format which the display does support.  Source buffers are queued with
+ * convert_queue(), and are no longer accessed once the converted buffer is
+ * returned by convert_dequeue().  Converted buffers are given back to the
+ * pool with convert_put() once the display is done with them.
+ */
+
+struct convert;
+
+/* Supported formats are YUYV, UYVY, NV12, I420 and RGB4 (fourcc 0) */
+struct convert * convert_open(struct display *disp, uint32_t fourcc,
+		uint32_t width, uint32_t height, uint32_t n);
+void convert_close(struct convert *conv);
+
+/* format of the converted buffers */
+uint32_t convert_fourcc(struct convert *conv);
+
+int convert_queue(struct convert *conv, struct buffer *src);
+struct buffer * convert_dequeue(struct convert *conv);
+void convert_put(struct convert *conv, struct buffer *dst);
+
+/* Scale (nearest neighbour) and convert a rectangle of src into one of an
+ * RGB dst, synchronously.  For compositing video into the UI layer when
+ * there are no more planes.  Returns -1 if the formats are not supported.
+ */
+int convert_blit(struct buffer *src, uint32_t sx, uint32_t sy,
+		uint32_t sw, uint32_t sh, struct buffer *dst,
+		uint32_t dx, uint32_t dy, uint32_t dw, uint32_t dh);
+
+/* Rotate a rectangle of src counter-clockwise by 0, 90, 180 or 270 degrees
+ * into the top left corner of dst, which has the same format.  The cpu
+ * fallback for planes which can't rotate.  Returns -1 if the format is not
+ * supported.
+ */
+int convert_rotate(struct buffer *src, uint32_t sx, uint32_t sy,
+		uint32_t sw, uint32_t sh, struct buffer *dst, uint32_t degrees);
+
+/* Memory accounting:
+ *
+ * The display backends (and apps, for bo's they allocate themselves) tag
+ * each bo with its purpose, to report the current and peak bytes allocated
+ * per purpose and tiling mode.
+ */
+
+enum mem_purpose {
+	MEM_SCANOUT,		/* RGB/UI buffers */
+	MEM_VIDEO,		/* video/overlay buffers */
+	MEM_INPUT,		/* bitstream input of the decoder */
+	MEM_PURPOSE_CNT,
+};
+
+/* flags are the OMAP_BO_x flags the bo was allocated with */
+void mem_track_bo(struct omap_bo *bo, enum mem_purpose purpose, uint32_t flags);
+/* call before omap_bo_del() */
+void mem_untrack_bo(struct omap_bo *bo);
+
+uint64_t mem_current_bytes(void);
+uint64_t mem_peak_bytes(void);
+
+/* print the report, as text or json (see mem_enable_report()) */
+void mem_report(FILE *f);
+
+/* print the report to stderr on exit, and on SIGUSR1.  format is "text"
+ * or "json".  Returns -1 if the format is not valid.
+ */
+int mem_enable_report(const char *format);
+
+/* print the report if SIGUSR1 was received since the last call */
+void mem_poll_report(void);
+
+/* Latency histograms:
+ *
+ * One histogram per pipeline stage (and per instance, ie. decoder, where
+ * that matters), recording durations in ns.  Recording is lock-free and
+ * can be done from any thread.
+ */
+
+struct hist;
+
+/* find or create the histogram with the given name, it stays around until
+ * exit.  Returns NULL on allocation failure, which hist_record() ignores.
+ */
+struct hist * hist_get(const char *fmt, ...)
+		__attribute__((format(printf, 1, 2)));
+void hist_record(struct hist *hist, uint64_t ns);
+
+/* print count, avg, p50, p90, p99 and max of each stage */
+void hist_report(FILE *f);
+/* print the report to stderr on exit */
+int hist_enable_report(void);
+
+/* Event tracing:
+ *
+ * With --trace <file>, pipeline events are recorded in a ring and written
+ * to the file as Chrome trace-event json (for Perfetto) on exit and on
+ * SIGUSR2.  The macros cost a branch when tracing is off.  Names must be
+ * string literals.
+ */
+
+extern bool trace_enabled;
+
+void trace_event(char ph, const char *name, const void *id, int64_t value);
+
+#define TRACE(ph, name, id, value) do { \
+		if (trace_enabled) \
+			trace_event(ph, name, id, value); \
+	} while (0)
+
+/* a span on the calling thread, id (ie. the buffer) is optional: */
+#define TRACE_BEGIN(name, id)		TRACE('B', name, id, 0)
+#define TRACE_END(name, id)		TRACE('E', name, id, 0)
+/* a span which may end on another thread, matched up by id: */
+#define TRACE_ASYNC_BEGIN(name, id)	TRACE('b', name, id, 0)
+#define TRACE_ASYNC_END(name, id)	TRACE('e', name, id, 0)
+#define TRACE_INSTANT(name, id)		TRACE('i', name, id, 0)
+#define TRACE_COUNTER(name, value)	TRACE('C', name, NULL, value)
+
+int trace_enable(const char *path);
+void trace_dump(void);
+/* dump the trace if SIGUSR2 was received since the last call */
+void trace_poll_dump(void);
+
 /* V4L2 utilities:
  */
 
@@ -153,6 +517,9 @@ int v4l2_qbuf(struct v4l2 *v4l2, struct buffer *buf);
 /* Dequeue buffer from camera */
 struct buffer * v4l2_dqbuf(struct v4l2 *v4l2);
 
+/* the fd which is readable when a buffer can be dequeued without waiting */
+int v4l2_get_fd(struct v4l2 *v4l2);
+
 /* Other utilities..
  */
 extern int debug;
@@ -161,9 +528,65 @@ int check_args(int argc, char **argv);
 
 void fill(struct buffer *buf, int i);
 
+/* Select the fill() implementation by name ("ref", "c", "sse2" or "neon"),
+ * or the fastest one supported by the cpu if name is NULL.  Returns -1 if
+ * the requested implementation is not available.
+ */
+int fill_select(const char *name);
+const char * fill_impl_name(void);
+
+/* Number of threads fill() splits the buffer across (0 means one per cpu) */
+int fill_set_threads(int n);
+int fill_get_threads(void);
+
+/* Generate frames by copying rows out of a cached, precomputed line of the
+ * test pattern, rather than computing every pixel.  The output is the same.
+ */
+void fill_set_template(bool enable);
+
+/* Worker pool: a set of persistent threads which all run the same job,
+ * each with its own index in [0, cnt).  The caller of workers_run() runs
+ * index 0 and returns once every thread has finished.
+ */
+struct workers;
+
+struct workers * workers_new(int n);
+void workers_free(struct workers *workers);
+int workers_count(struct workers *workers);
+void workers_run(struct workers *workers,
+		void (*fn)(void *arg, int idx, int cnt), void *arg);
+
 #define FOURCC(a, b, c, d) ((uint32_t)(uint8_t)(a) | ((uint32_t)(uint8_t)(b) << 8) | ((uint32_t)(uint8_t)(c) << 16) | ((uint32_t)(uint8_t)(d) << 24 ))
 #define FOURCC_STR(str)    FOURCC(str[0], str[1], str[2], str[3])
 
+/* number of planes of a (video buffer) format */
+static inline int
+fourcc_planes(uint32_t fourcc)
+{
+	switch (fourcc) {
+	case FOURCC('N','V','1','2'):
+		return 2;
+	case FOURCC('I','4','2','0'):
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+/* cpu pointer to a plane of a buffer, which is either in a bo of its own,
+ * or at an offset in bo[0] when there are fewer bo's than planes, or in
+ * system memory when there are no bo's at all:
+ */
+static inline void *
+buffer_plane(struct buffer *buf, int i)
+{
+	if (!buf->nbo)
+		return (char *)buf->map + buf->offsets[i];
+	if (i < buf->nbo)
+		return omap_bo_map(buf->bo[i]);
+	return (char *)omap_bo_map(buf->bo[0]) + buf->offsets[i];
+}
+
 /* Dynamic debug. */
 #define DBG(fmt, ...) \
 		do { if (debug) fprintf(stderr, fmt "\n", ##__VA_ARGS__); } while (0)
@@ -178,6 +601,10 @@ void fill(struct buffer *buf, int i);
     (type *)((char *)(ptr) - (char *) &((type *)0)->member)
 #endif
 
+#ifndef ARRAY_SIZE
+#  define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
 #ifndef MIN
 #  define MIN(a,b)     (((a) < (b)) ? (a) : (b))
 #endif
@@ -197,25 +624,27 @@ void fill(struct buffer *buf, int i);
 /* align x to next highest multiple of 2^n */
 #define ALIGN2(x,n)   (((x) + ((1 << (n)) - 1)) & ~((1 << (n)) - 1))
 
-#include <sys/time.h>
-static inline long
-mark(long *last)
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Time in nanoseconds, from CLOCK_MONOTONIC, which is not affected by NTP
+ * or settimeofday() steps.
+ */
+#include <time.h>
+static inline uint64_t
+time_ns(void)
 {
-	struct timeval t;
-	gettimeofday(&t, NULL);
-	if (last) {
-		long delta = t.tv_usec - *last;
-
-		/* Handle the case, where the seconds have changed.
-		 * TODO: keep the whole timeval struct, to be able to cope with
-		 * more than one second deltas? */
-		if (t.tv_usec < *last)
-			delta += 1000000;
-
-		*last = t.tv_usec;
-		return delta;
-	}
-	return t.tv_usec;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * NSEC_PER_SEC) + t.tv_nsec;
+}
+
+/* nanoseconds since *last, which is then set to the current time */
+static inline uint64_t
+mark_ns(uint64_t *last)
+{
+	uint64_t now = time_ns(), delta = now - *last;
+	*last = now;
+	return delta;
 }
 
 #endif /* UTIL_H_ */
@@ -426,12 +426,21 @@ v4l2_dqbuf(struct v4l2 *v4l2)
 			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 			.memory = V4L2_MEMORY_DMABUF,
 	};
+	static struct hist *hist;
+	uint64_t t;
 	int ret;
 
+	if (!hist)
+		hist = hist_get("v4l2 dqbuf");
+
+	TRACE_BEGIN("v4l2 dqbuf", NULL);
+	t = time_ns();
 	ret = ioctl(v4l2->fd, VIDIOC_DQBUF, &v4l2buf);
 	if (ret) {
 		ERROR("VIDIOC_DQBUF failed: %s (%d)", strerror(errno), ret);
 	}
+	hist_record(hist, time_ns() - t);
+	TRACE_END("v4l2 dqbuf", NULL);
 
 	buf = v4l2->bufs[v4l2buf.index];
 
@@ -441,3 +450,9 @@ v4l2_dqbuf(struct v4l2 *v4l2)
 
 	return buf;
 }
+
+int
+v4l2_get_fd(struct v4l2 *v4l2)
+{
+	return v4l2->fd;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2011 Texas Instruments
+ * Author: Rob Clark <rob.clark@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <pthread.h>
+
+/* A small pool of persistent threads, which all run the same job function
+ * (each with its own index) and are then waited on.  The calling thread
+ * runs index 0 itself, so a pool of n only spawns n-1 threads.
+ */
+
+struct worker {
+	struct workers *workers;
+	int idx;
+	pthread_t thread;
+};
+
+struct workers {
+	int n;
+	struct worker *threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned int gen;	/* incremented for each new job */
+	int pending;		/* threads which have not finished the job yet */
+	bool quit;
+
+	void (*fn)(void *arg, int idx, int cnt);
+	void *arg;
+};
+
+static void *
+worker_thread(void *data)
+{
+	struct worker *worker = data;
+	struct workers *workers = worker->workers;
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&workers->lock);
+	while (true) {
+		while ((gen == workers->gen) && !workers->quit)
+			pthread_cond_wait(&workers->start, &workers->lock);
+
+		if (workers->quit)
+			break;
+
+		gen = workers->gen;
+		pthread_mutex_unlock(&workers->lock);
+
+		workers->fn(workers->arg, worker->idx, workers->n);
+
+		pthread_mutex_lock(&workers->lock);
+		if (--workers->pending == 0)
+			pthread_cond_signal(&workers->done);
+	}
+	pthread_mutex_unlock(&workers->lock);
+
+	return NULL;
+}
+
+struct workers *
+workers_new(int n)
+{
+	struct workers *workers;
+	int i;
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+
+	workers = calloc(1, sizeof(*workers));
+	if (!workers) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+
+	workers->threads = calloc(n, sizeof(*workers->threads));
+	if (!workers->threads) {
+		ERROR("allocation failed");
+		free(workers);
+		return NULL;
+	}
+
+	pthread_mutex_init(&workers->lock, NULL);
+	pthread_cond_init(&workers->start, NULL);
+	pthread_cond_init(&workers->done, NULL);
+
+	/* index 0 is the caller of workers_run(): */
+	workers->n = 1;
+	for (i = 1; i < n; i++) {
+		struct worker *worker = &workers->threads[i];
+		int ret;
+
+		worker->workers = workers;
+		worker->idx = i;
+
+		ret = pthread_create(&worker->thread, NULL, worker_thread, worker);
+		if (ret) {
+			ERROR("could not create worker thread: %s", strerror(ret));
+			break;
+		}
+
+		workers->n++;
+	}
+
+	DBG("started %d worker threads", workers->n - 1);
+
+	return workers;
+}
+
+void
+workers_free(struct workers *workers)
+{
+	int i;
+
+	if (!workers)
+		return;
+
+	pthread_mutex_lock(&workers->lock);
+	workers->quit = true;
+	pthread_cond_broadcast(&workers->start);
+	pthread_mutex_unlock(&workers->lock);
+
+	for (i = 1; i < workers->n; i++)
+		pthread_join(workers->threads[i].thread, NULL);
+
+	pthread_cond_destroy(&workers->done);
+	pthread_cond_destroy(&workers->start);
+	pthread_mutex_destroy(&workers->lock);
+
+	free(workers->threads);
+	free(workers);
+}
+
+int
+workers_count(struct workers *workers)
+{
+	return workers ? workers->n : 1;
+}
+
+void
+workers_run(struct workers *workers,
+		void (*fn)(void *arg, int idx, int cnt), void *arg)
+{
+	if (!workers || (workers->n == 1)) {
+		fn(arg, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&workers->lock);
+	workers->fn = fn;
+	workers->arg = arg;
+	workers->pending = workers->n - 1;
+	workers->gen++;
+	pthread_cond_broadcast(&workers->start);
+	pthread_mutex_unlock(&workers->lock);
+
+	fn(arg, 0, workers->n);
+
+	pthread_mutex_lock(&workers->lock);
+	while (workers->pending > 0)
+		pthread_cond_wait(&workers->done, &workers->lock);
+	pthread_mutex_unlock(&workers->lock);
+}
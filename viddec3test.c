@@ -33,6 +33,16 @@
 /* Padding for height as per Codec requirement (for h264)*/
 #define PADY  24
 
+/* frames due longer ago than this are dropped instead of displayed: */
+#define LATE_NS  (20 * 1000000LL)
+
+/* Dropping a decoded frame saves no decoding, so when decoding is slower
+ * than real time, the stream clock starts over from now after this many
+ * drops in a row, or for a frame due longer ago than RESYNC_NS:
+ */
+#define MAX_DROPS  4
+#define RESYNC_NS  (500 * 1000000LL)
+
 struct decoder {
 	struct display *disp;
 	struct demux *demux;
@@ -52,8 +62,16 @@ struct decoder {
 	struct omap_bo *input_bo;
 	int input_sz, uv_offset;
 
-	suseconds_t tdisp;
+	/* output buffer the codec asked to be given again (outBufsInUseFlag) */
+	struct buffer *inuse;
 
+	struct hist *demux_hist, *decode_hist, *post_hist;
+
+	/* stream clock: a frame is due at clock_base + (pts - pts_base) */
+	bool use_pts, clock_valid;
+	uint64_t clock_base;
+	int64_t pts_base, last_pts;
+	unsigned int presented, late, dropped, drops_in_row, resyncs;
 };
 
 /* When true, do not actually call VIDDEC3_process. For benchmarking. */
@@ -62,16 +80,24 @@ static int no_process = 0;
 /* When true, loop at end of playback. */
 static int loop = 0;
 
+/* When true, present frames according to their pts, unless the stream has
+ * an --fps of its own.
+ */
+static int use_pts = 1;
+
 static void
 usage(char *name)
 {
-	MSG("Usage: %s [OPTIONS] INFILE", name);
+	MSG("Usage: %s [OPTIONS] INFILE [-- [OPTIONS] INFILE]...", name);
 	MSG("Test of viddec3 decoder.");
+	MSG("Up to 8 streams are decoded at once, each with options of its own, and");
+	MSG("shown side by side (see --grid and --window).");
 	MSG("");
 	MSG("viddec3test options:");
 	MSG("\t-h, --help: Print this help and exit.");
 	MSG("\t--loop\tRestart playback at end of stream.");
 	MSG("\t--no-process\tDo not actually call VIDDEC3_process method. For benchmarking.");
+	MSG("\t--no-pts\tPresent frames as soon as they are decoded, instead of at their pts.");
 	MSG("");
 	disp_usage();
 }
@@ -79,6 +105,11 @@ usage(char *name)
 static void
 decoder_close(struct decoder *decoder)
 {
+	if (decoder->use_pts)
+		MSG("%p: %u frames presented, %u late, %u dropped, clock restarted %u times",
+				decoder, decoder->presented, decoder->late,
+				decoder->dropped, decoder->resyncs);
+
 	if (decoder->codec)          VIDDEC3_delete(decoder->codec);
 	if (decoder->engine)         Engine_close(decoder->engine);
 	if (decoder->params)         dce_free(decoder->params);
@@ -88,7 +119,10 @@ decoder_close(struct decoder *decoder)
 	if (decoder->outBufs)        free(decoder->outBufs);
 	if (decoder->inArgs)         dce_free(decoder->inArgs);
 	if (decoder->outArgs)        dce_free(decoder->outArgs);
-	if (decoder->input_bo)       omap_bo_del(decoder->input_bo);
+	if (decoder->input_bo) {
+		mem_untrack_bo(decoder->input_bo);
+		omap_bo_del(decoder->input_bo);
+	}
 	if (decoder->demux)          demux_deinit(decoder->demux);
 	if (decoder->disp)           disp_close(decoder->disp);
 
@@ -114,6 +148,13 @@ decoder_open(int argc, char **argv)
 	if (!decoder->disp)
 		goto usage;
 
+	/* an explicit --fps takes precedence over the stream's timestamps: */
+	decoder->use_pts = use_pts;
+	if (decoder->use_pts && decoder->disp->rtctl.fps_num) {
+		MSG("%p: --fps given, ignoring pts", decoder);
+		decoder->use_pts = false;
+	}
+
 	/* loop thru args, find input file.. */
 	for (i = 1; i < argc; i++) {
 		int fd;
@@ -147,7 +188,11 @@ decoder_open(int argc, char **argv)
 	height = ALIGN2 (height, 4);       /* round up to macroblocks */
 	padded_width  = ALIGN2 (width + (2*PADX), 7);
 	padded_height = height + 4*PADY;
-	num_buffers   = MIN(16, 32768 / ((width/16) * (height/16))) + 3;
+	/* reference frames, plus the one being decoded and the one on screen
+	 * (which the display holds a reference to, so it can't be reused
+	 * while it is scanned out):
+	 */
+	num_buffers   = MIN(16, 32768 / ((width/16) * (height/16))) + 2;
 
 	MSG("%p: padded_width=%d, padded_height=%d, num_buffers=%d",
 			decoder, padded_width, padded_height, num_buffers);
@@ -160,6 +205,7 @@ decoder_open(int argc, char **argv)
 	decoder->input_sz = width * height;
 	decoder->input_bo = omap_bo_new(decoder->disp->dev,
 			decoder->input_sz, OMAP_BO_WC);
+	mem_track_bo(decoder->input_bo, MEM_INPUT, OMAP_BO_WC);
 	decoder->input = omap_bo_map(decoder->input_bo);
 
 	decoder->framebuf = disp_get_fb(decoder->disp);
@@ -258,7 +304,9 @@ MSG("displayBufsMode: %d", decoder->params->displayBufsMode);
 	decoder->outArgs = dce_alloc(sizeof(IVIDDEC3_OutArgs));
 	decoder->outArgs->size = sizeof(IVIDDEC3_OutArgs);
 
-	decoder->tdisp = mark(NULL);
+	decoder->demux_hist = hist_get("%p demux", decoder);
+	decoder->decode_hist = hist_get("%p decode", decoder);
+	decoder->post_hist = hist_get("%p post", decoder);
 
 	return decoder;
 
@@ -270,6 +318,73 @@ fail:
 	return NULL;
 }
 
+/* Wait until the frame is due on the stream clock.  Returns false if it is
+ * too late, and should be dropped.
+ */
+static bool
+frame_due(struct decoder *decoder, struct buffer *buf)
+{
+	uint64_t now, due;
+	struct timespec ts;
+
+	if (!decoder->use_pts || (buf->pts == DEMUX_NOPTS))
+		return true;
+
+	now = time_ns();
+
+	/* start the clock on the first frame, and again when the pts jumps
+	 * back (ie. when looping):
+	 */
+	if (!decoder->clock_valid || (buf->pts < decoder->last_pts)) {
+		decoder->clock_base = now;
+		decoder->pts_base = buf->pts;
+		decoder->clock_valid = true;
+	}
+	decoder->last_pts = buf->pts;
+
+	due = decoder->clock_base + (buf->pts - decoder->pts_base);
+
+	if ((now > due + LATE_NS) && (now < due + RESYNC_NS) &&
+			(decoder->drops_in_row < MAX_DROPS)) {
+		DBG("%p: dropping frame %p, %lluus late", decoder, buf,
+				(unsigned long long)(now - due) / 1000);
+		decoder->dropped++;
+		decoder->drops_in_row++;
+		TRACE_INSTANT("drop", buf);
+		TRACE_COUNTER("dropped", decoder->dropped);
+		return false;
+	}
+
+	/* too far behind to catch up, start over from now rather than
+	 * dropping every frame from here on:
+	 */
+	if (now > due + LATE_NS) {
+		DBG("%p: %lluus behind, restarting the stream clock", decoder,
+				(unsigned long long)(now - due) / 1000);
+		decoder->clock_base = now;
+		decoder->pts_base = buf->pts;
+		decoder->resyncs++;
+		due = now;
+	}
+	decoder->drops_in_row = 0;
+
+	if (now > due) {
+		decoder->late++;
+		TRACE_COUNTER("late", decoder->late);
+	} else {
+		TRACE_BEGIN("wait pts", buf);
+		ts.tv_sec = due / NSEC_PER_SEC;
+		ts.tv_nsec = due % NSEC_PER_SEC;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			continue;
+		TRACE_END("wait pts", buf);
+	}
+
+	decoder->presented++;
+
+	return true;
+}
+
 static int
 decoder_process(struct decoder *decoder)
 {
@@ -280,7 +395,20 @@ decoder_process(struct decoder *decoder)
 	struct buffer *buf;
 	int i, n;
 
-	buf = disp_get_vid_buffer(decoder->disp);
+	int64_t pts = DEMUX_NOPTS;
+	bool inuse = false;
+	uint64_t t;
+
+	/* the codec holds a reference to each buffer we give it until it
+	 * shows up in freeBufID:
+	 */
+	if (decoder->inuse) {
+		buf = decoder->inuse;
+		decoder->inuse = NULL;
+		inuse = true;
+	} else {
+		buf = disp_get_vid_buffer(decoder->disp);
+	}
 	if (!buf) {
 		ERROR("%p: fail: out of buffers", decoder);
 		return -1;
@@ -288,7 +416,11 @@ decoder_process(struct decoder *decoder)
 
 	/* demux; in loop mode, we can do two tries at the end of the stream. */
 	for (i = 0; i < 2; i++) {
-		n = demux_read(decoder->demux, decoder->input, decoder->input_sz);
+		TRACE_BEGIN("demux", decoder);
+		t = time_ns();
+		n = demux_read(decoder->demux, decoder->input, decoder->input_sz, &pts);
+		hist_record(decoder->demux_hist, time_ns() - t);
+		TRACE_END("demux", decoder);
 		if (n) {
 			inBufs->descs[0].bufSize.bytes = n;
 			inArgs->numBytes = n;
@@ -315,6 +447,12 @@ decoder_process(struct decoder *decoder)
 		break;
 	}
 
+	/* the frame is decoded into the buffer, so it carries the pts along
+	 * to outputID.  The second field of a frame keeps the first's pts:
+	 */
+	if (!inuse)
+		buf->pts = pts;
+
 	inArgs->inputID = (XDAS_Int32)buf;
 	outBufs->descs[0].buf = (XDAS_Int8 *)omap_bo_handle(buf->bo[0]);
 
@@ -339,10 +477,11 @@ decoder_process(struct decoder *decoder)
 
 	} else {
 		XDAS_Int32 err;
-		suseconds_t tproc;
-		tproc = mark(NULL);
+		TRACE_BEGIN("decode", buf);
+		t = time_ns();
 		err = VIDDEC3_process(decoder->codec, inBufs, outBufs, inArgs, outArgs);
-		DBG("%p: processed returned in: %ldus", decoder, (long int)mark(&tproc));
+		hist_record(decoder->decode_hist, time_ns() - t);
+		TRACE_END("decode", buf);
 		if (err) {
 			ERROR("%p: process returned error: %d", decoder, err);
 			ERROR("%p: extendedError: %08x", decoder, outArgs->extendedError);
@@ -357,14 +496,18 @@ decoder_process(struct decoder *decoder)
 
 		/* get the output buffer and write it to file */
 		buf = (struct buffer *)outArgs->outputID[i];
+		if (!frame_due(decoder, buf))
+			continue;
+
 		DBG("%p: post buffer: %p %d,%d %d,%d", decoder, buf,
 				r->topLeft.x, r->topLeft.y,
 				r->bottomRight.x, r->bottomRight.y);
+		t = time_ns();
 		disp_post_vid_buffer(decoder->disp, buf,
 				r->topLeft.x, r->topLeft.y,
 				r->bottomRight.x - r->topLeft.x,
 				r->bottomRight.y - r->topLeft.y);
-		DBG("%p: display in: %ldus", decoder, (long int)mark(&decoder->tdisp));
+		hist_record(decoder->post_hist, time_ns() - t);
 	}
 
 	for (i = 0; outArgs->freeBufID[i]; i++) {
@@ -372,8 +515,12 @@ decoder_process(struct decoder *decoder)
 		disp_put_vid_buffer(decoder->disp, buf);
 	}
 
+	/* the codec is not done with the output buffer (ie. only one field
+	 * of it has been decoded), and wants it back in the next call:
+	 */
 	if (outArgs->outBufsInUseFlag) {
-		MSG("%p: TODO... outBufsInUseFlag", decoder); // XXX
+		decoder->inuse = (struct buffer *)inArgs->inputID;
+		DBG("%p: output buffer still in use: %p", decoder, decoder->inuse);
 	}
 
 	return (inBufs->numBufs > 0) ? 0 : -1;
@@ -398,6 +545,10 @@ main(int argc, char **argv)
 			no_process = 1;
 			argv[i] = NULL;
 
+		} else if (!strcmp(argv[i], "--no-pts")) {
+			use_pts = 0;
+			argv[i] = NULL;
+
 		} else if (!strcmp(argv[i], "--")) {
 			argv[first] = argv[0];
 			decoders[ndecoders++] = decoder_open(i - first, &argv[first]);
@@ -411,7 +562,11 @@ main(int argc, char **argv)
 	do {
 		for (i = 0, n = 0; i < ndecoders; i++) {
 			if (decoders[i]) {
-				int ret = decoder_process(decoders[i]);
+				int ret;
+
+				TRACE_BEGIN("frame", decoders[i]);
+				ret = decoder_process(decoders[i]);
+				TRACE_END("frame", decoders[i]);
 				if (ret) {
 					decoder_close(decoders[i]);
 					decoders[i] = NULL;